@@ -1,36 +1,92 @@
+
 #include "crc.h"
 
-/* #define DEBUG  */
+#if (CRC_SLICE != 1) && (CRC_SLICE != 4) && (CRC_SLICE != 8)
+#error CRC_SLICE has to be 1, 4 or 8
+#endif
+
+static ULONG crc_table[CRC_SLICE][256];
+static int   crc_table_ready = 0;
 
-static void _crc32 (unsigned char b, ULONG *reg32)
+/*
+ * crc_table[0][b] is the CRC register after shifting in byte b,
+ * crc_table[k][b] the same followed by k zero bytes.
+ */
+
+static void crc32_make_table(void)
 {
-    int i;
+    int   i, j, k;
     ULONG p = 0xedb88320;		/* generator polynom */
 
-    for (i=0; i<8; ++i)
+    for (i=0; i<256; i++)
+    {
+        ULONG reg32 = i;
+        for (j=0; j<8; j++)
+        {
+            if (reg32 & 1)
+                reg32 = (reg32>>1)^p;
+            else
+                reg32 >>= 1;
+        }
+        crc_table[0][i] = reg32;
+    }
+
+    for (k=1; k<CRC_SLICE; k++)
     {
-        if ( (*reg32 & 1) != (b & 1) )
-             *reg32 = (*reg32>>1)^p; 
-        else 
-             *reg32 >>= 1;
-        b >>= 1;
+        for (i=0; i<256; i++)
+        {
+            ULONG reg32 = crc_table[k-1][i];
+            crc_table[k][i] = (reg32>>8) ^ crc_table[0][reg32 & 0xff];
+        }
     }
+
+    crc_table_ready = 1;
 }
 
-ULONG crc32(unsigned char *data, int len)
+ULONG crc32_update(ULONG reg32, unsigned char *data, int len)
 {
-    int i;
-    ULONG reg32 = 0xffffffff; /* shift register */
-
-    for (i=0; i<len; i++)  {
-        unsigned char x = data[i];
-        _crc32(x, &reg32);
-#ifdef DEBUG
-        if (i>349 && i<399)
-           printf ("crc32: i=%d, x=%02x, reg32=%08x\n", i, x, reg32);
+    if (!crc_table_ready)
+        crc32_make_table();
+
+    /* the multi byte steps only ever index the tables with single bytes,
+       so they work on big and little endian CPUs and need no aligned
+       longword access (which would trap on a 68000)                     */
+
+#if CRC_SLICE == 8
+    while (len >= 8)
+    {
+        reg32 = crc_table[7][(reg32 ^ data[0]) & 0xff]       ^
+                crc_table[6][((reg32>>8) ^ data[1]) & 0xff]  ^
+                crc_table[5][((reg32>>16) ^ data[2]) & 0xff] ^
+                crc_table[4][(reg32>>24) ^ data[3]]          ^
+                crc_table[3][data[4]]                        ^
+                crc_table[2][data[5]]                        ^
+                crc_table[1][data[6]]                        ^
+                crc_table[0][data[7]];
+        data += 8;
+        len  -= 8;
+    }
 #endif
+#if CRC_SLICE >= 4
+    while (len >= 4)
+    {
+        reg32 = crc_table[3][(reg32 ^ data[0]) & 0xff]       ^
+                crc_table[2][((reg32>>8) ^ data[1]) & 0xff]  ^
+                crc_table[1][((reg32>>16) ^ data[2]) & 0xff] ^
+                crc_table[0][(reg32>>24) ^ data[3]];
+        data += 4;
+        len  -= 4;
     }
+#endif
 
-    return reg32 ^ 0xffffffff;
+    while (len-- > 0)
+        reg32 = crc_table[0][(reg32 ^ *data++) & 0xff] ^ (reg32>>8);
+
+    return reg32;
+}
+
+ULONG crc32(unsigned char *data, int len)
+{
+    return crc32_final(crc32_update(crc32_init(), data, len));
 }
 
@@ -1,9 +1,42 @@
+
 #ifndef HAVE_CRC_H
 #define HAVE_CRC_H
 
+#ifdef CRC_HOST
+typedef unsigned int ULONG;	/* building crcbench on a 32/64 bit host */
+#else
 #include <exec/types.h>
+#endif
+
+/*
+ * CRC32 engine (polynom 0xedb88320), selected at build time:
+ *
+ *   CRC_SLICE=1 : one 256 entry table, one byte per step (1k of tables)
+ *   CRC_SLICE=4 : slicing-by-4, four bytes per step      (4k of tables)
+ *   CRC_SLICE=8 : slicing-by-8, eight bytes per step     (8k of tables)
+ *
+ * all variants produce bit-identical results, use crcbench to find
+ * the fastest one for a given CPU.
+ */
+
+#ifndef CRC_SLICE
+#define CRC_SLICE 1
+#endif
 
 ULONG crc32(unsigned char *data, int len);
 
+/*
+ * incremental interface, for data that arrives in pieces:
+ *
+ *   reg32 = crc32_init();
+ *   reg32 = crc32_update(reg32, chunk, chunk_len);   (any number of times)
+ *   crc   = crc32_final(reg32);
+ */
+
+#define crc32_init()       ((ULONG) 0xffffffff)
+#define crc32_final(reg32) ((reg32) ^ 0xffffffff)
+
+ULONG crc32_update(ULONG reg32, unsigned char *data, int len);
+
 #endif
 
@@ -0,0 +1,165 @@
+/*
+ * crcbench - CRC32 engine self test and throughput benchmark
+ *
+ * Copyright 2019 G. Bartsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * usage: crcbench [kbytes]
+ *
+ * checks crc32() against the original bit-serial implementation, then
+ * reports the throughput of the CRC_SLICE variant it was built with.
+ * Runs on the Amiga (aztec c) as well as on a unix host (-DCRC_HOST).
+ */
+
+#include <stdio.h>
+
+#include "crc.h"
+
+#ifdef CRC_HOST
+
+#include <stdlib.h>
+#include <time.h>
+
+static long now_ms(void)
+{
+   return (long) (clock() / (CLOCKS_PER_SEC / 1000));
+}
+
+#else
+
+#include <functions.h>
+#include <libraries/dos.h>
+
+static long now_ms(void)
+{
+   struct DateStamp ds;
+
+   DateStamp(&ds);
+   return (ds.ds_Minute * 60L * 50L + ds.ds_Tick) * 20L;
+}
+
+#endif
+
+#define BENCH_BUFSIZE 1024
+
+static unsigned char bench_buf[BENCH_BUFSIZE];
+
+/* reference: the bit-serial engine crc.c used to implement */
+
+static ULONG crc32_ref(unsigned char *data, int len)
+{
+   int   i, j;
+   ULONG reg32 = 0xffffffff;
+   ULONG p     = 0xedb88320;
+
+   for (i=0; i<len; i++)
+   {
+      unsigned char b = data[i];
+      for (j=0; j<8; ++j)
+      {
+         if ( (reg32 & 1) != (b & 1) )
+            reg32 = (reg32>>1)^p;
+         else
+            reg32 >>= 1;
+         b >>= 1;
+      }
+   }
+
+   return reg32 ^ 0xffffffff;
+}
+
+static int self_test(void)
+{
+   int   off, len, errors = 0;
+   ULONG c1, c2;
+
+   c1 = crc32((unsigned char *) "123456789", 9);
+   if (c1 != 0xcbf43926)
+   {
+      printf("FAIL: check value is %08lx, expected cbf43926\n", (unsigned long) c1);
+      errors++;
+   }
+
+   /* all alignments and tail lengths */
+   for (off=0; off<8; off++)
+   {
+      for (len=0; len<300; len++)
+      {
+         c1 = crc32(bench_buf+off, len);
+         c2 = crc32_ref(bench_buf+off, len);
+         if (c1 != c2)
+         {
+            printf("FAIL: off=%d len=%d: %08lx vs %08lx\n",
+                   off, len, (unsigned long) c1, (unsigned long) c2);
+            errors++;
+         }
+      }
+   }
+
+   /* incremental interface, fed in uneven chunks */
+   for (len=1; len<40; len++)
+   {
+      ULONG reg32 = crc32_init();
+      for (off=0; off<BENCH_BUFSIZE; off+=len)
+         reg32 = crc32_update(reg32, bench_buf+off,
+                              off+len > BENCH_BUFSIZE ? BENCH_BUFSIZE-off : len);
+      c1 = crc32_final(reg32);
+      c2 = crc32_ref(bench_buf, BENCH_BUFSIZE);
+      if (c1 != c2)
+      {
+         printf("FAIL: chunk=%d: %08lx vs %08lx\n",
+                len, (unsigned long) c1, (unsigned long) c2);
+         errors++;
+      }
+   }
+
+   return errors;
+}
+
+int main(int argc, char **argv)
+{
+   long  kbytes = 1024;
+   long  i, t0, t1, kbps;
+   ULONG sum = 0;
+
+   if (argc > 1)
+      kbytes = atol(argv[1]);
+
+   for (i=0; i<BENCH_BUFSIZE; i++)
+      bench_buf[i] = (unsigned char) (i * 7 + (i >> 5));
+
+   printf("crcbench: CRC_SLICE=%d\n", CRC_SLICE);
+
+   if (self_test())
+      return 10;
+   printf("self test ok.\n");
+
+   t0 = now_ms();
+   for (i=0; i<kbytes; i++)
+      sum += crc32(bench_buf, BENCH_BUFSIZE);
+   t1 = now_ms();
+
+   if (t1 <= t0)
+      t1 = t0 + 1;
+
+   kbps = kbytes * 1000L / (t1 - t0);
+
+   printf("%ld KB in %ld ms: %ld.%02ld MB/s (%08lx)\n",
+          kbytes, t1 - t0, kbps / 1024, (kbps % 1024) * 100 / 1024,
+          (unsigned long) sum);
+
+   return 0;
+}
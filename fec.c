@@ -0,0 +1,251 @@
+
+#include "fec.h"
+
+static unsigned char fec_exp[2*FEC_N+2];  /* a^i, twice so sums need no mod */
+static unsigned char fec_log[FEC_N+1];
+static int           fec_glog[FEC_MAX_PARITY]; /* generator, -1: coefficient 0 */
+static int           fec_p = 0;                /* what fec_glog[] was built for */
+
+/* a codeword being decoded, and what the decoder works with */
+static unsigned char fec_cw[FEC_N];
+static unsigned char fec_syn[FEC_MAX_PARITY];
+static unsigned char fec_lambda[FEC_MAX_PARITY+1];
+static unsigned char fec_b[FEC_MAX_PARITY+1];
+static unsigned char fec_omega[FEC_MAX_PARITY];
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    if (!a || !b)
+        return 0;
+    return fec_exp[fec_log[a] + fec_log[b]];
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b)
+{
+    if (!a)
+        return 0;
+    return fec_exp[fec_log[a] + FEC_N - fec_log[b]];
+}
+
+static void fec_setup(int parity)
+{
+    unsigned char g[FEC_MAX_PARITY+1];   /* lowest coefficient first */
+    int           i, j, x;
+
+    if (parity == fec_p)
+        return;
+
+    if (!fec_p)
+    {
+        x = 1;
+        for (i=0; i<FEC_N; i++)
+        {
+            fec_exp[i]         = (unsigned char) x;
+            fec_exp[i + FEC_N] = (unsigned char) x;
+            fec_log[x]         = (unsigned char) i;
+            x <<= 1;
+            if (x & 0x100)
+                x ^= 0x11d;
+        }
+        fec_exp[2*FEC_N]   = fec_exp[0];
+        fec_exp[2*FEC_N+1] = fec_exp[1];
+    }
+
+    /* g(x) = (x - a^0) (x - a^1) ... (x - a^(p-1)) */
+    g[0] = 1;
+    for (i=0; i<parity; i++)
+    {
+        g[i+1] = g[i];
+        for (j=i; j>0; j--)
+            g[j] = g[j-1] ^ gf_mul(g[j], fec_exp[i]);
+        g[0] = gf_mul(g[0], fec_exp[i]);
+    }
+    for (i=0; i<parity; i++)
+        fec_glog[i] = g[i] ? fec_log[g[i]] : -1;
+
+    fec_p = parity;
+}
+
+long fec_size(long len, int parity)
+{
+    return (len + FEC_N - parity - 1) / (FEC_N - parity) * parity;
+}
+
+long fec_data(long len, int parity)
+{
+    return len - (len + FEC_N - 1) / FEC_N * parity;
+}
+
+void fec_encode(unsigned char *buf, long len, unsigned char *par, int parity)
+{
+    unsigned char reg[FEC_MAX_PARITY];
+    long          c = fec_size(len, parity) / parity;
+    long          j, t;
+    int           m;
+
+    fec_setup(parity);
+
+    for (j=0; j<c; j++)
+    {
+        for (m=0; m<parity; m++)
+            reg[m] = 0;
+
+        /* remainder of the division by g, one data byte at a time */
+        for (t=j; t<len; t+=c)
+        {
+            unsigned char fb = buf[t] ^ reg[0];
+
+            if (fb)
+            {
+                int l = fec_log[fb];
+
+                for (m=0; m<parity-1; m++)
+                    reg[m] = reg[m+1] ^ (fec_glog[parity-1-m] < 0 ? 0 :
+                                         fec_exp[l + fec_glog[parity-1-m]]);
+                reg[parity-1] = fec_glog[0] < 0 ? 0 : fec_exp[l + fec_glog[0]];
+            }
+            else
+            {
+                for (m=0; m<parity-1; m++)
+                    reg[m] = reg[m+1];
+                reg[parity-1] = 0;
+            }
+        }
+
+        for (m=0; m<parity; m++)
+            par[m*c + j] = reg[m];
+    }
+}
+
+/* corrects fec_cw[0..n-1], returns the number of errors or -1 */
+static int fec_fix(int n, int parity)
+{
+    int           i, k, t, l = 0, m = 1, roots = 0;
+    unsigned char bb = 1;
+    unsigned char any = 0;
+
+    /* syndromes: the received word at the roots of g */
+    for (i=0; i<parity; i++)
+    {
+        unsigned char s = 0;
+
+        for (t=0; t<n; t++)
+            s = gf_mul(s, fec_exp[i]) ^ fec_cw[t];
+        fec_syn[i] = s;
+        any       |= s;
+    }
+    if (!any)
+        return 0;
+
+    /* Berlekamp-Massey: the error locator, lowest coefficient first */
+    for (i=0; i<=parity; i++)
+    {
+        fec_lambda[i] = 0;
+        fec_b[i]      = 0;
+    }
+    fec_lambda[0] = 1;
+    fec_b[0]      = 1;
+
+    for (k=0; k<parity; k++)
+    {
+        unsigned char d = fec_syn[k];
+
+        for (i=1; i<=l; i++)
+            d ^= gf_mul(fec_lambda[i], fec_syn[k-i]);
+
+        if (!d)
+            m++;
+        else
+        {
+            unsigned char q = gf_div(d, bb);
+            unsigned char tmp[FEC_MAX_PARITY+1];
+
+            for (i=0; i<=parity; i++)
+                tmp[i] = fec_lambda[i];
+            for (i=m; i<=parity; i++)
+                fec_lambda[i] ^= gf_mul(q, fec_b[i-m]);
+
+            if (2*l <= k)
+            {
+                l  = k + 1 - l;
+                bb = d;
+                for (i=0; i<=parity; i++)
+                    fec_b[i] = tmp[i];
+                m  = 1;
+            }
+            else
+                m++;
+        }
+    }
+    if (2*l > parity)
+        return -1;
+
+    /* omega = syndromes * lambda mod x^p */
+    for (i=0; i<parity; i++)
+    {
+        unsigned char o = 0;
+
+        for (k=0; k<=i; k++)
+            o ^= gf_mul(fec_lambda[k], fec_syn[i-k]);
+        fec_omega[i] = o;
+    }
+
+    /* Chien search over the positions of this codeword, Forney for each */
+    for (t=0; t<n; t++)
+    {
+        int           e    = n - 1 - t;            /* power of x       */
+        int           xinv = (FEC_N - e) % FEC_N;  /* log of a^-e      */
+        unsigned char v    = 0, num = 0, den = 0;
+
+        for (i=0; i<=l; i++)
+            v ^= gf_mul(fec_lambda[i], fec_exp[(xinv * i) % FEC_N]);
+        if (v)
+            continue;
+
+        for (i=0; i<parity; i++)
+            num ^= gf_mul(fec_omega[i], fec_exp[(xinv * i) % FEC_N]);
+        for (i=1; i<=l; i+=2)
+            den ^= gf_mul(fec_lambda[i], fec_exp[(xinv * (i-1)) % FEC_N]);
+        if (!den)
+            return -1;
+
+        fec_cw[t] ^= gf_mul(fec_exp[e], gf_div(num, den));
+        roots++;
+    }
+
+    return roots == l ? l : -1;
+}
+
+long fec_decode(unsigned char *buf, long len, unsigned char *par, int parity)
+{
+    long c     = fec_size(len, parity) / parity;
+    long fixed = 0;
+    long j, t;
+    int  n, m, r;
+
+    fec_setup(parity);
+
+    for (j=0; j<c; j++)
+    {
+        n = 0;
+        for (t=j; t<len; t+=c)
+            fec_cw[n++] = buf[t];
+        for (m=0; m<parity; m++)
+            fec_cw[n++] = par[m*c + j];
+
+        r = fec_fix(n, parity);
+        if (r < 0)
+            return -1;
+        if (!r)
+            continue;
+
+        n = 0;
+        for (t=j; t<len; t+=c)
+            buf[t] = fec_cw[n++];
+        for (m=0; m<parity; m++)
+            par[m*c + j] = fec_cw[n++];
+        fixed += r;
+    }
+
+    return fixed;
+}
@@ -0,0 +1,41 @@
+
+#ifndef HAVE_FEC_H
+#define HAVE_FEC_H
+
+/*
+ * Reed-Solomon forward error correction for MSG_BLOCK payloads
+ * (FTS4_F_FEC)
+ *
+ * a payload of len bytes is split into c = ceil(len / (255-p)) codewords
+ * of a (shortened) RS(255,255-p) code over GF(256), polynom 0x11d, roots
+ * a^0..a^(p-1). Codewords are interleaved: byte i of the payload belongs
+ * to codeword i % c, so is parity byte r of codeword j, which is sent as
+ * byte r*c + j of the c*p parity bytes that follow the payload. A burst
+ * of errors is spread over all codewords, each of which can repair p/2
+ * bytes. The first byte of a codeword is its highest coefficient, the
+ * parity bytes are the remainder of the division by the generator.
+ *
+ * the tables take 1k of memory. Encoding costs p table lookups per
+ * byte, the decoder only runs on frames that fail their CRC.
+ */
+
+#define FEC_MAX_PARITY  32   /* p, even */
+#define FEC_N          255
+
+/* parity bytes for a payload of len bytes */
+long fec_size(long len, int parity);
+
+/* payload size of a frame of len bytes, parity included */
+long fec_data(long len, int parity);
+
+/* computes the fec_size() parity bytes for buf into par */
+void fec_encode(unsigned char *buf, long len, unsigned char *par, int parity);
+
+/*
+ * repairs buf and par in place, returns the number of bytes corrected,
+ * -1 if a codeword has more errors than the code can handle
+ */
+long fec_decode(unsigned char *buf, long len, unsigned char *par, int parity);
+
+#endif
+
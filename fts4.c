@@ -25,30 +25,81 @@
 #include <stdarg.h>
 
 extern struct DosLibrary *DOSBase;
+extern long atol();
 
 /* V36 stuff */
 extern BOOL SetFileDate(const char *name, struct DateStamp *date);
 #pragma amicall(DOSBase,0x18c, SetFileDate(d1,d2));
+extern LONG SetFileSize(BPTR fh, LONG pos, LONG mode);
+#pragma amicall(DOSBase,0x1c8, SetFileSize(d1,d2,d3));
+extern LONG SameLock(BPTR lock1, BPTR lock2);
+#pragma amicall(DOSBase,0x1a4, SameLock(d1,d2));
+#ifndef LOCK_DIFFERENT
+#define LOCK_SAME        0
+#define LOCK_DIFFERENT (-1)
+#endif
+#ifndef ST_SOFTLINK
+#define ST_ROOT          1
+#define ST_USERDIR       2
+#define ST_SOFTLINK      3
+#define ST_LINKDIR       4
+#define ST_FILE        (-3)
+#define ST_LINKFILE    (-4)
+#endif
 
 #include "crc.h"
+#include "lz.h"
+#include "fec.h"
 
 #define VERSION "0.3.2"
 
 /* #define DEBUG_BYTES */
 
 #define DEFAULT_BAUDRATE  19200
+#define DEFAULT_BAUD_MAX 115200
+#define DEFAULT_PARITY       16  /* -F, FEC bytes per 255 byte codeword */
 #define DEFAULT_DEVICE    "serial.device"
 
 static ULONG baudrate    = DEFAULT_BAUDRATE;
+static ULONG baud_start  = DEFAULT_BAUDRATE; /* -b, where sessions start */
+static ULONG baud_max    = DEFAULT_BAUD_MAX; /* -B, MSG_BAUD limit       */
+static int   fec_parity  = DEFAULT_PARITY;   /* -F, FTS4_F_FEC default   */
 static char *device_name = DEFAULT_DEVICE;
 
 #define BUFSIZE      1024
 #define READSIZE      512
+#define MAX_BLOCKSIZE 16384 /* frame len is a signed WORD */
+#define BLOCK_OVERHEAD   20 /* header, offset, CRC        */
+#define MAX_RBUFLEN   65536
+#define MIN_BLOCKSIZE   256
+#define FRAME_HEAD       12 /* msgbuf room for the header in front, */
+#define FRAME_TAIL        4 /* and for the CRC behind the payload   */
+#define TX_MAX      BUFSIZE /* other payloads are copied, up to that   */
+#define RXBUF_SIZE     1024 /* receive read-ahead, see rx_take()       */
+
+/* adaptive block size, see tx_blocksize() */
+#define BLOCK_COST       64 /* byte times lost per frame besides its data */
+#define LINK_WINDOW  131072 /* bytes of history the error rate covers    */
 #define PATH_MAX      512
+#define IOBUF_MAX   65536 /* file read-ahead, shrunk to fit free memory */
+#define IOBUF_MIN    4096
 #define DIRBUF_SIZE 16384
-
-#define SERIAL_TIMEOUT_SECS  1
-#define SERIAL_TIMEOUT_MIRCO 0
+#define DIRENT_SIZE    29                       /* ax_dirent on the wire  */
+#define DIRENT_MAX     (DIRENT_SIZE + 108 + 80) /* + fib name and comment */
+#define DIR_UNKNOWN    0xffffffff
+#define DIR_CACHE_KB   64  /* default for -C */
+#define MAX_VOLUMES    32
+#define VOL_TTL        60  /* secs, volume table is rebuilt at least this often */
+#define INFO_TTL       10  /* secs, Info() results are that old at most         */
+
+#define SERIAL_TIMEOUT_SECS  1        /* waiting for the peer's next message  */
+#define RTO_MIN          20000L       /* usecs, limits of the adaptive timeout */
+#define RTO_MAX        4000000L
+
+#define BAUD_MIN          1200L
+#define BAUD_PROBE_LEN     256        /* pattern bytes in a MSG_BAUD probe    */
+#define BAUD_BAD_RUN         3        /* corrupted headers in a row: -b rate  */
+#define BAUD_FILE    "S:fts4.%.32s.baud" /* last good rate per device       */
 
 #define LOG_DEBUG2    0
 #define LOG_DEBUG     1
@@ -76,6 +127,16 @@ static int loglevel = LOG_INFO;
 #define MSG_FILE_ATTR   0x6b
 #define MSG_FILE_CLOSE  0x6d
 
+#define MSG_FILE_QUERY   0x70 /* FTS4_F_RESUME */
+#define MSG_FILE_RESUME  0x71
+#define MSG_FILE_SEND_AT 0x72
+#define MSG_FILE_SIGS    0x73 /* FTS4_F_DELTA */
+#define MSG_FILE_DELTA   0x74
+#define MSG_BLOCK_LZ     0x75 /* FTS4_F_COMPRESS */
+#define MSG_FILE_BATCH   0x76 /* FTS4_F_BATCH */
+#define MSG_TREE_SEND    0x77 /* FTS4_F_TREE */
+#define MSG_BAUD         0x78 /* FTS4_F_BAUD */
+
 struct ax_header 
 {
    UBYTE sync;
@@ -85,6 +146,9 @@ struct ax_header
    ULONG crc;
 } ;
 
+#define ACK_OK          0x506b4f6b /* PkOk */
+#define ACK_RESEND      0x506b5273 /* PkRs */
+
 #define AX_FILE_TYPE_DIR  2
 #define AX_FILE_TYPE_FILE 3
 
@@ -113,28 +177,365 @@ struct ax_dirent
    UBYTE type2; 
 };
 
+/*
+ * FTS4 protocol extensions
+ *
+ * a client that knows about them appends a struct fts4_init to its
+ * MSG_INIT payload, we answer "Cloanto" followed by our own struct
+ * fts4_init holding the subset of flags (and parameters) both sides
+ * support. Clients that do not (lxamiga, Amiga Explorer) get a plain
+ * "Cloanto" and the classic AX protocol.
+ *
+ * wire layout (big endian):  0 magic "FTS4"
+ *                            4 version
+ *                            6 flags
+ *                            8 window
+ *                           10 blocksize
+ *                           12 parity
+ *
+ * FTS4_F_WINDOW: MSG_BLOCK transfers are pipelined. The sender streams up
+ *   to <window> MSG_BLOCK frames (followed by a final MSG_EOF frame) with
+ *   consecutive seq numbers without waiting in between. Downloads start
+ *   with a single MSG_NEXT_PART, uploads right after the MSG_MPARTH
+ *   exchange; no MSG_NEXT_PART is sent per block. The receiver answers
+ *   every frame of the stream (including the MSG_EOF) with 8 bytes:
+ *   "PkOk" + seq: all frames up to and including seq arrived (cumulative),
+ *   "PkRs" + seq: frame seq is missing/corrupt, resend everything from seq.
+ *
+ * FTS4_F_BLOCKSIZE: MSG_BLOCK frames (both directions) carry up to
+ *   <blocksize> bytes of data instead of 512 (files) / 1020 (dirs).
+ *   We answer with the size we managed to allocate buffers for. Blocks we
+ *   send shrink (down to MIN_BLOCKSIZE) and grow again with the error
+ *   rate we observe on the line.
+ *
+ * FTS4_F_DIRSTREAM: MSG_DIR listings start right away instead of after
+ *   a counting pass over the directory. MSG_MPARTH and the entry count
+ *   in front of the listing are 0xffffffff then, the listing ends with
+ *   the MSG_EOF.
+ *
+ * FTS4_F_RESUME: interrupted transfers can be continued.
+ *   MSG_FILE_QUERY  (ULONG len, path) is answered with a MSG_FILE_QUERY
+ *     carrying struct fts4_query: the size of the file and the CRC32 of
+ *     its first len bytes (fewer if the file is shorter), MSG_IOERR if
+ *     it cannot be opened. len 0xffffffff checks the whole file, e.g.
+ *     after an upload.
+ *   MSG_FILE_RESUME (ULONG pos, MSG_FILE_RECV payload) is MSG_FILE_RECV
+ *     for an existing file: it is cut to pos bytes and the MSG_MPARTH
+ *     (still carrying the full size) and MSG_BLOCKs that follow continue
+ *     it from there. Pre-V36 systems cannot cut files, they refuse to
+ *     resume anywhere but at the end of the file.
+ *   MSG_FILE_SEND_AT (ULONG pos, path) is MSG_FILE_SEND with the first
+ *     MSG_BLOCK starting at pos.
+ *   All three are answered with MSG_IOERR if the flag was not agreed on.
+ *
+ * FTS4_F_DELTA: existing files are updated by sending the differences.
+ *   MSG_FILE_SIGS (ULONG blocksize, path) is answered like a MSG_DIR:
+ *     MSG_MPARTH with the size, then the table is fetched with
+ *     MSG_NEXT_PART/MSG_BLOCK. It holds the file size and the block size
+ *     used (clipped to DELTA_MIN_BS..DELTA_MAX_BS), followed by a weak and
+ *     a strong (CRC32) checksum per block. The last block may be short.
+ *     The weak checksum is rsync's: for bytes x[0..n-1] of a block,
+ *     a = sum x[i], b = sum (n-i) * x[i], weak = (b << 16) | a (mod 2^16
+ *     each), so the host can roll it over the new file byte by byte.
+ *   MSG_FILE_DELTA (ULONG blocksize, MSG_FILE_RECV payload) starts the
+ *     upload of a new version of the file. MSG_MPARTH carries the size of
+ *     the new file, the MSG_BLOCKs a stream of instructions:
+ *       0x80000000 | n            n literal bytes follow
+ *       block, count              copy count blocks of the old file
+ *     (all ULONGs). The new file is built next to the old one, as
+ *     name.fts4new (name cut short if need be), and replaces it at
+ *     MSG_FILE_CLOSE if it came out complete. The request fails if
+ *     something of that name is already there.
+ *   Both are answered with MSG_IOERR if the flag was not agreed on.
+ *
+ * FTS4_F_COMPRESS: MSG_BLOCKs (both directions, files and listings) may
+ *   be sent as MSG_BLOCK_LZ instead: ULONG pos, UWORD len, followed by
+ *   the len data bytes packed by lz_pack() (see lz.h). Blocks that do
+ *   not get smaller are sent as plain MSG_BLOCK.
+ *
+ * FTS4_F_BATCH: MSG_FILE_BATCH (ULONG len, path) uploads many files into
+ *   the existing directory path in one go. Like after MSG_MPARTH, the
+ *   client then sends len bytes (0xffffffff: unknown) in MSG_BLOCKs and a
+ *   MSG_EOF, followed by MSG_FILE_CLOSE. The data is a sequence of
+ *   entries, a struct batch_entry followed by the name (relative to path,
+ *   parents first, no ':' and no leading or double '/', those entries
+ *   fail) and the comment, both 0 terminated, and for files
+ *   size bytes of data. Existing directories are fine, existing files are
+ *   skipped like MSG_FILE_RECV refuses them. MSG_FILE_CLOSE answers
+ *   MSG_IOERR first if any entry failed. MSG_FILE_BATCH is answered with
+ *   MSG_IOERR if the flag was not agreed on.
+ *
+ * FTS4_F_TREE: MSG_TREE_SEND (path) is the other direction: everything
+ *   below directory path in one stream of batch entries (directories
+ *   before their contents), answered like a MSG_DIR with FTS4_F_DIRSTREAM:
+ *   MSG_MPARTH 0xffffffff, then the stream is fetched with MSG_NEXT_PART
+ *   and ends with MSG_EOF. Files that cannot be opened are left out, files
+ *   that shrink while they are sent are padded with zeros. Links to files
+ *   are sent as the file, links to directories are left out. A stream
+ *   that cannot be continued (asked for data that has left our buffer)
+ *   ends with MSG_IOERR in place of the MSG_EOF. Without the flag agreed
+ *   on, MSG_TREE_SEND is answered with MSG_IOERR.
+ *
+ * FTS4_F_BAUD: the client may move the session to a faster rate.
+ *   MSG_BAUD (ULONG rate) is answered with a MSG_BAUD carrying the rate
+ *   we agree to, 0 if it is above -B or the device refuses it. Once
+ *   that answer is acked, both sides switch, and after a pause of 100ms
+ *   (our time to do so) the client sends a probe: a MSG_BAUD carrying
+ *   the rate followed by the byte values 0..BAUD_PROBE_LEN-1. We ack it
+ *   and send it back unchanged; if that echo gets acked as well, the new
+ *   rate sticks. Otherwise both sides return to the old rate: we after
+ *   a second without an intact probe or an ack for the echo, the client
+ *   after two seconds without an intact echo. Clients step up through
+ *   the rates they want to try and stop at the first one that fails.
+ *   MSG_BAUD 0 asks for the rate the last negotiation on this device
+ *   ended at (0: none yet), the one to try first. Sessions always start
+ *   at the -b rate: we return to it after BAUD_BAD_RUN corrupted headers
+ *   in a row, and a client that gets no answer at a faster rate should
+ *   do the same.
+ *
+ * FTS4_F_FEC: MSG_BLOCK and MSG_BLOCK_LZ frames (both directions) carry
+ *   Reed-Solomon parity behind their payload, <parity> bytes for every
+ *   255-<parity> payload bytes (see fec.h), and the CRC covers both. A
+ *   frame that fails its CRC is repaired if it can be, and only NACKed if
+ *   not. The client asks for an even parity of 2..FEC_MAX_PARITY, 0 leaves
+ *   it to us (-F).
+ */
+
+#define FTS4_MAGIC         0x46545334 /* FTS4 */
+#define FTS4_VERSION       1
+
+#define FTS4_F_WINDOW      0x0001
+#define FTS4_F_BLOCKSIZE   0x0002
+#define FTS4_F_DIRSTREAM   0x0004
+#define FTS4_F_RESUME      0x0008
+#define FTS4_F_DELTA       0x0010
+#define FTS4_F_COMPRESS    0x0020
+#define FTS4_F_BATCH       0x0040
+#define FTS4_F_TREE        0x0080
+#define FTS4_F_BAUD        0x0100
+#define FTS4_F_FEC         0x0200
+
+#define FTS4_SUPPORTED     (FTS4_F_WINDOW | FTS4_F_BLOCKSIZE | FTS4_F_DIRSTREAM | \
+                            FTS4_F_RESUME | FTS4_F_DELTA | FTS4_F_COMPRESS | \
+                            FTS4_F_BATCH | FTS4_F_TREE | FTS4_F_BAUD | \
+                            FTS4_F_FEC)
+
+#define DELTA_MIN_BS          256
+#define DELTA_MAX_BS         8192
+#define DELTA_LITERAL  0x80000000
+#define DELTA_NEW      ".fts4new" /* new version is built under name+this */
+#define DELTA_OLD      ".fts4old" /* old one waits here until it is in place */
+#define DOS_NAME_MAX         30   /* longest file name the filesystems take */
+
+#define MAX_WINDOW              8
+#define STREAM_ACK_TIMEOUTS     3 /* each one doubles the timeout        */
+#define ACK_TIMEOUTS            3 /* stop-and-wait sends of a frame      */
+
+struct fts4_init
+{
+   ULONG magic;
+   UWORD version;
+   UWORD flags;
+   UWORD window;
+   UWORD blocksize;
+   UWORD parity;
+};
+
+struct batch_entry
+{
+   ULONG size;    /* file data following the entry          */
+   ULONG attrs;
+   ULONG date;    /* ds_Days                                */
+   ULONG time;    /* ds_Minute                              */
+   UWORD len;     /* of the entry, including name and comment */
+   UBYTE type;    /* AX_FILE_TYPE_DIR / AX_FILE_TYPE_FILE   */
+   UBYTE pad;
+};
+
+#define BATCH_ENTRY_MAX  (sizeof(struct batch_entry) + 108 + 80)
+
+/* MSG_TREE_SEND: one per directory level being walked */
+struct tree_level
+{
+   struct FileInfoBlock  fib;      /* first, AllocMem() keeps it aligned */
+   struct tree_level    *up;
+   BPTR                  lock;
+   int                   base;     /* tree_path length of the parent     */
+};
+
+struct fts4_query
+{
+   ULONG size;   /* of the file                  */
+   ULONG len;    /* bytes the CRC covers         */
+   ULONG crc;
+};
+
+static UWORD                 session_flags     = 0;
+static UWORD                 session_window    = 1;
+static LONG                  session_blocksize = READSIZE;
+static int                   session_parity    = 0;   /* FTS4_F_FEC */
+
+static ULONG                 link_bytes  = 0;   /* recent traffic            */
+static ULONG                 link_errors = 0;   /* frame errors in it, * 256 */
+static LONG                  link_blocksize = READSIZE;
+
 static ULONG                 wait_mask;
 static struct MsgPort       *mp_serial   = NULL;
-static struct IOExtSer      *io_serial   = NULL;
+static struct IOExtSer      *io_serial   = NULL;    /* writes, queries   */
+static struct IOExtSer      *io_serial_rd = NULL;   /* reads             */
 static BOOL                  serial_open = FALSE;
+static struct ax_header      rx_header;
+static BOOL                  rd_prefetched = FALSE; /* rx_header read posted */
 
-static struct timerequest    io_tr;
+static struct timerequest    io_tr;              /* the deadline timer      */
+static struct timerequest    io_clock;           /* TR_GETSYSTIME           */
 static BOOL                  timer_open  = FALSE;
+static BOOL                  tr_armed    = FALSE; /* io_tr is posted        */
+static ULONG                 tr_expires;         /* when it goes off...     */
+static ULONG                 tr_deadline;        /* ...and when it should   */
+static LONG                  rto_srtt    = 0;    /* usecs, see rto_sample() */
+static LONG                  rto_var     = 0;
+static LONG                  rto         = SERIAL_TIMEOUT_SECS * 1000000L;
+static BOOL                  rx_idle     = FALSE; /* no deadline for the peer */
 
 static struct FileHandle    *io_file     = NULL;
 static ULONG                 io_flags=0;
+static ULONG                 io_file_pos;        /* DOS file position */
+static UBYTE                *iobuf       = NULL;  /* read-ahead, write-behind */
+static LONG                  iobuf_size  = 0;
+static ULONG                 iobuf_pos;           /* file offset of iobuf[0] */
+static ULONG                 ra_len;              /* bytes read ahead        */
+static LONG                  wb_len      = 0;     /* bytes waiting to be written */
+static ULONG                 wb_out;              /* where wb_append() goes on   */
+static ULONG                 ra_next;             /* where the stream continues */
+static BOOL                  ra_eof;
+static BOOL                  io_write_failed = FALSE;
 static struct ax_recv        recv;
 static char                  filename[PATH_MAX];
 static char                  newname[PATH_MAX];
 static ULONG                 receiving=0, received;
 static ULONG                 sending=0, sent;
+static ULONG                 resume_pos = 0;     /* MSG_FILE_RESUME offset */
+static UBYTE                *sig_buf    = NULL;  /* MSG_FILE_SIGS table    */
+static ULONG                 sig_len;
+static struct FileHandle    *delta_old  = NULL;  /* MSG_FILE_DELTA source  */
+static char                  delta_tmp[PATH_MAX];
+static char                  delta_bak[PATH_MAX];
+static ULONG                 delta_bs, delta_size;
+static ULONG                 delta_pos;          /* instruction bytes done */
+static ULONG                 delta_old_pos;
+static ULONG                 delta_lit;          /* literal bytes to come  */
+static UBYTE                 delta_op[8];        /* instruction so far     */
+static int                   delta_op_len;
+static BOOL                  batch      = FALSE; /* MSG_FILE_BATCH upload  */
+static char                  batch_path[PATH_MAX];
+static int                   batch_base;         /* strlen() of its dir    */
+static ULONG                 batch_pos;          /* stream bytes done      */
+static struct batch_entry    batch_e;            /* entry being unpacked   */
+static UBYTE                 batch_hdr[BATCH_ENTRY_MAX];
+static int                   batch_hdr_len;      /* bytes of it so far     */
+static char                 *batch_comment;
+static BOOL                  batch_ok;
+static ULONG                 batch_left;         /* file data to come      */
+static ULONG                 batch_files, batch_failed;
+static struct tree_level    *tree_lv    = NULL;  /* MSG_TREE_SEND walk     */
+static char                  tree_path[PATH_MAX];
+static int                   tree_root;          /* strlen() of the root   */
+static struct FileHandle    *tree_fh    = NULL;  /* file being streamed    */
+static ULONG                 tree_left;          /* its bytes still to come */
+static UBYTE                *tree_buf   = NULL;  /* ring of stream bytes   */
+static LONG                  tree_size;
+static ULONG                 tree_lo, tree_hi;   /* stream range in it     */
+static ULONG                 tree_files;
+static ULONG                 tx_keep;            /* oldest stream offset we
+                                                    may have to send again */
 static struct Lock          *lock = NULL;
 static struct FileInfoBlock *fib = NULL;
 static char                 *dirbuf = NULL;
-static ULONG                 dirbuf_todo = 0, dirbuf_done = 0;
+static ULONG                 dirbuf_done = 0;
 static BOOL                  dirbuf_sending = FALSE;
+static struct FileLock      *dir_lock  = NULL;  /* directory being listed    */
+static ULONG                 dir_total;         /* size sent in MSG_MPARTH   */
+static ULONG                 dir_count;         /* entries, listed up front  */
+static ULONG                 dir_base, dir_fill;/* listing range in dirbuf   */
+
+/*
+ * directory listings we have sent, most recently used first. An entry is
+ * good as long as the fib_Date of its directory stays the same; anything
+ * we change on disk ourselves flushes them all.
+ */
+struct dir_cache
+{
+   struct dir_cache *next;
+   struct DateStamp  date;    /* fib_Date of the directory   */
+   ULONG             size;    /* listing bytes in data       */
+   ULONG             alloc;   /* bytes allocated for data    */
+   UBYTE            *data;
+   char              path[1]; /* allocated to fit            */
+};
+
+static ULONG                 dir_cache_max  = DIR_CACHE_KB * 1024L;
+static ULONG                 dir_cache_used = 0;
+static struct dir_cache     *dir_cache      = NULL;
+static struct dir_cache     *dir_cached     = NULL; /* listing being sent   */
+static UBYTE                *dc_build       = NULL; /* listing being walked */
+static ULONG                 dc_build_alloc, dc_build_len, dc_build_count;
+static struct DateStamp      dc_build_date;
+
+/*
+ * mounted volumes for root listings. The DOS list is only looked at
+ * (under Forbid()) to see whether it changed, Lock() and Info() happen
+ * outside and their results are kept for INFO_TTL seconds.
+ */
+struct vol_cache
+{
+   struct DeviceList *node;      /* identity, never dereferenced later */
+   struct DateStamp   date;
+   char               name[108]; /* "name:" */
+   ULONG              size, used;
+   WORD               attrs;
+   BOOL               info_ok;
+   ULONG              info_time;
+};
+
+static struct vol_cache      vol_cache[MAX_VOLUMES];
+static int                   vol_count = 0;
+static ULONG                 vol_sig   = 0;
+static ULONG                 vol_time  = 0;
+static BOOL                  vol_valid = FALSE;
 static struct InfoData      *info_data = NULL;
-static char                  cmdbuf[BUFSIZE];
+static UBYTE                *msgbuf      = NULL;
+static LONG                  msgbuf_size = 0;
+static UBYTE                 txbuf[FRAME_HEAD + TX_MAX + FRAME_TAIL];
+static UBYTE                 rxbuf[RXBUF_SIZE];
+static int                   rx_pos = 0;        /* rxbuf bytes not taken    */
+static int                   rx_len = 0;        /* yet are rx_pos..rx_len-1 */
+static BOOL                  rx_asked = FALSE;  /* sent something, the answer
+                                                   cannot be here yet       */
+
+static ULONG                 serial_ios   = 0;  /* device I/O requests... */
+static ULONG                 serial_waits = 0;  /* ...we had to wait for... */
+static ULONG                 serial_bytes = 0;  /* ...and what they moved */
+static ULONG                 rx_bad       = 0;  /* corrupted headers...    */
+static ULONG                 rx_dropped   = 0;  /* ...and bytes skipped    */
+static int                   rx_bad_run   = 0;  /* corrupted headers in a row */
+
+static UBYTE                *lzbuf      = NULL; /* FTS4_F_COMPRESS       */
+static LONG                  lzbuf_size = 0;
+static ULONG                 lz_data    = 0;    /* MSG_BLOCK data bytes...  */
+static ULONG                 lz_wire    = 0;    /* ...and what they took    */
+static ULONG                 lz_blocks  = 0;
+static ULONG                 lz_raw     = 0;    /* blocks that didn't shrink */
+
+static ULONG                 fec_fixed  = 0;    /* frames repaired...       */
+static ULONG                 fec_bytes  = 0;    /* ...bytes corrected in them */
+static ULONG                 fec_failed = 0;    /* frames beyond repair     */
+static ULONG                 tx_resent  = 0;    /* frames we sent again     */
+
+static ULONG                 tx_seq    = 0;     /* seq of our next frame     */
+static ULONG                 rx_seq    = 0;     /* seq expected from peer    */
+static BOOL                  rx_stream = FALSE; /* receiving a MSG_BLOCK stream */
+static BOOL                  rx_nacked = FALSE; /* gap reported, drop until filled */
 
 static void log(int level, char *msg, ...)
 {
@@ -149,6 +550,168 @@ static void log(int level, char *msg, ...)
    fflush(stdout);
 }
 
+static void dc_free(struct dir_cache *e)
+{
+   ULONG l = sizeof(struct dir_cache) + strlen(e->path);
+
+   if (e == dir_cached)
+      dir_cached = NULL;
+   dir_cache_used -= l + e->alloc;
+   FreeMem(e->data, e->alloc);
+   FreeMem(e, l);
+}
+
+static void dir_cache_flush(void)
+{
+   while (dir_cache)
+   {
+      struct dir_cache *e = dir_cache;
+      dir_cache = e->next;
+      dc_free(e);
+   }
+}
+
+/* cached listing of filename, if its directory (in fib) did not change */
+static struct dir_cache *dir_cache_find(void)
+{
+   struct dir_cache **pe;
+
+   for (pe = &dir_cache; *pe; pe = &(*pe)->next)
+   {
+      struct dir_cache *e = *pe;
+
+      if (strcmp(e->path, filename))
+         continue;
+
+      *pe = e->next;
+      if ( (e->date.ds_Days   != fib->fib_Date.ds_Days)   ||
+           (e->date.ds_Minute != fib->fib_Date.ds_Minute) ||
+           (e->date.ds_Tick   != fib->fib_Date.ds_Tick) )
+      {
+         log(LOG_DEBUG, "dir cache: %s is stale\n", filename);
+         dc_free(e);
+         return NULL;
+      }
+      e->next   = dir_cache;
+      dir_cache = e;
+      return e;
+   }
+   return NULL;
+}
+
+static void dc_build_drop(void)
+{
+   if (dc_build)
+      FreeMem(dc_build, dc_build_alloc);
+   dc_build = NULL;
+}
+
+/* start collecting the listing that is about to be walked */
+static void dc_build_start(void)
+{
+   dc_build_drop();
+
+   dc_build_alloc = dir_total != DIR_UNKNOWN ? dir_total : 4096;
+   if (dc_build_alloc > dir_cache_max)
+      return;
+
+   dc_build       = AllocMem(dc_build_alloc, 0);
+   dc_build_len   = 4;
+   dc_build_count = 0;
+   dc_build_date  = fib->fib_Date;
+}
+
+/* len listing bytes at stream offset pos, as they are generated */
+static void dc_build_put(ULONG pos, char *p, ULONG len)
+{
+   if (!dc_build)
+      return;
+
+   if (pos + len > dc_build_alloc)
+   {
+      ULONG  n = dc_build_alloc * 2;
+      UBYTE *b;
+
+      while (n < pos + len)
+         n *= 2;
+      b = n <= dir_cache_max ? AllocMem(n, 0) : NULL;
+      if (!b)
+      {
+         dc_build_drop();
+         return;
+      }
+      CopyMem(dc_build, b, dc_build_len);
+      FreeMem(dc_build, dc_build_alloc);
+      dc_build       = b;
+      dc_build_alloc = n;
+   }
+
+   CopyMem(p, dc_build + pos, len);
+   if (pos + len > dc_build_len)
+      dc_build_len = pos + len;
+}
+
+/* the walk is complete, file the listing under filename */
+static void dc_build_done(void)
+{
+   struct dir_cache *e;
+   ULONG             l;
+
+   if (!dc_build)
+      return;
+
+   /* the count may not have been known when the listing started */
+   CopyMem((char*)&dc_build_count, dc_build, 4);
+
+   /* grown by doubling, don't keep the slack */
+   if (dc_build_len < dc_build_alloc)
+   {
+      UBYTE *b = AllocMem(dc_build_len, 0);
+      if (b)
+      {
+         CopyMem(dc_build, b, dc_build_len);
+         FreeMem(dc_build, dc_build_alloc);
+         dc_build       = b;
+         dc_build_alloc = dc_build_len;
+      }
+   }
+
+   l = sizeof(struct dir_cache) + strlen(filename);
+
+   /* make room, least recently used first */
+   while (dir_cache && (dir_cache_used + l + dc_build_alloc > dir_cache_max))
+   {
+      struct dir_cache **pe = &dir_cache;
+
+      while ((*pe)->next)
+         pe = &(*pe)->next;
+      e   = *pe;
+      *pe = NULL;
+      log(LOG_DEBUG, "dir cache: evicting %s\n", e->path);
+      dc_free(e);
+   }
+
+   e = dir_cache_used + l + dc_build_alloc <= dir_cache_max ? AllocMem(l, 0) : NULL;
+   if (!e)
+   {
+      dc_build_drop();
+      return;
+   }
+
+   strcpy(e->path, filename);
+   e->date  = dc_build_date;
+   e->size  = dc_build_len;
+   e->alloc = dc_build_alloc;
+   e->data  = dc_build;
+   e->next  = dir_cache;
+   dir_cache = e;
+   dir_cache_used += l + dc_build_alloc;
+   dc_build = NULL;
+
+   log(LOG_DEBUG, "dir cache: %s, %d bytes, %d/%d used\n", 
+       e->path, e->size, dir_cache_used, dir_cache_max);
+}
+
 static void closedown(void)
 {
    log(LOG_DEBUG, "closedown procedure starts.\n");
@@ -158,9 +721,18 @@ static void closedown(void)
       AbortIO((struct IORequest*)io_serial);
       log(LOG_DEBUG, "closedown: WaitIO\n");
       WaitIO((struct IORequest*)io_serial);
+      if (io_serial_rd)
+      {
+         AbortIO((struct IORequest*)io_serial_rd);
+         WaitIO((struct IORequest*)io_serial_rd);
+      }
       log(LOG_DEBUG, "closedown: CloseDevice\n");
       CloseDevice((struct IORequest*)io_serial);
    }
+   if (io_serial_rd)
+   {
+      DeleteExtIO( (struct IORequest *) io_serial_rd);
+   }
    if (io_serial)
    {
       log(LOG_DEBUG, "closedown: DeleteExtIO\n");
@@ -176,16 +748,49 @@ static void closedown(void)
       log(LOG_DEBUG, "closedown: Close file\n");
       Close((BPTR) io_file);
    }
+   if (delta_old)
+   {
+      Close((BPTR) delta_old);
+   }
+   if (tree_fh)
+   {
+      Close((BPTR) tree_fh);
+   }
+   while (tree_lv)
+   {
+      struct tree_level *lv = tree_lv;
+
+      tree_lv = lv->up;
+      UnLock(lv->lock);
+      FreeMem(lv, sizeof(struct tree_level));
+   }
+   if (tree_buf)
+   {
+      FreeMem(tree_buf, tree_size);
+   }
+   if (sig_buf)
+   {
+      FreeMem(sig_buf, sig_len);
+   }
    if (lock)
    {
       UnLock((BPTR) lock);
    }
+   if (dir_lock)
+   {
+      UnLock((BPTR) dir_lock);
+   }
+   dir_cache_flush();
+   dc_build_drop();
    if (timer_open)
    {
-      log(LOG_DEBUG, "closedown: AbortIO timer\n");
-      AbortIO((struct IORequest*)&io_tr);
-      log(LOG_DEBUG, "closedown: WaitIO timer\n");
-      WaitIO((struct IORequest*)&io_tr);
+      if (tr_armed)
+      {
+         log(LOG_DEBUG, "closedown: AbortIO timer\n");
+         AbortIO((struct IORequest*)&io_tr);
+         log(LOG_DEBUG, "closedown: WaitIO timer\n");
+         WaitIO((struct IORequest*)&io_tr);
+      }
       log(LOG_DEBUG, "closedown: CloseDevice timer\n");
       CloseDevice((struct IORequest*)&io_tr);
    }
@@ -204,6 +809,20 @@ static void closedown(void)
       log(LOG_DEBUG, "closedown: free info_data\n");
       FreeMem(info_data, sizeof(struct InfoData));
    }
+   if (iobuf)
+   {
+      log(LOG_DEBUG, "closedown: free iobuf\n");
+      FreeMem(iobuf, iobuf_size);
+   }
+   if (lzbuf)
+   {
+      FreeMem(lzbuf, lzbuf_size);
+   }
+   if (msgbuf)
+   {
+      log(LOG_DEBUG, "closedown: free msgbuf\n");
+      FreeMem(msgbuf - FRAME_HEAD, msgbuf_size + FRAME_HEAD + FRAME_TAIL);
+   }
    log(LOG_INFO, "goodbye.\n");
    exit();
 }
@@ -214,8 +833,14 @@ static void print_usage(char *myname)
    printf ("   -v            : increase verbosity\n");
    printf ("   -b <baudrate> : set serial baudrate, default: %d\n", 
            DEFAULT_BAUDRATE);
+   printf ("   -B <baudrate> : fastest rate clients may switch to, default: %ld, 0: off\n",
+           (ULONG) DEFAULT_BAUD_MAX);
    printf ("   -D <device>   : serial device, default: %s\n", 
            DEFAULT_DEVICE);
+   printf ("   -C <kbytes>   : directory cache size, default: %d\n", 
+           DIR_CACHE_KB);
+   printf ("   -F <parity>   : FEC bytes per 255 byte codeword, default: %d, 0: off\n",
+           DEFAULT_PARITY);
    closedown();
 }
 
@@ -234,7 +859,16 @@ static void parse_commandline(int argc, char **argv)
          i++;
          if (i>=argc)
             print_usage(argv[0]);
-         baudrate = atoi(argv[i]);
+         baudrate   = atol(argv[i]);
+         baud_start = baudrate;
+         i++;   
+      }
+      else if (!strcmp(argv[i], "-B"))
+      {
+         i++;
+         if (i>=argc)
+            print_usage(argv[0]);
+         baud_max = atol(argv[i]);
          i++;   
       }
       else if (!strcmp(argv[i], "-D"))
@@ -245,16 +879,33 @@ static void parse_commandline(int argc, char **argv)
          device_name = argv[i];
          i++;   
       }
+      else if (!strcmp(argv[i], "-C"))
+      {
+         i++;
+         if (i>=argc)
+            print_usage(argv[0]);
+         dir_cache_max = atoi(argv[i]) * 1024L;
+         i++;   
+      }
+      else if (!strcmp(argv[i], "-F"))
+      {
+         i++;
+         if (i>=argc)
+            print_usage(argv[0]);
+         fec_parity = atoi(argv[i]);
+         i++;   
+      }
       else
          print_usage(argv[0]);
    }
 }
 
-static void setup_serial(ULONG baud)
+static void setup_serial(ULONG baud, ULONG rbuf_len)
 {
-   log (LOG_INFO, "setting baudrate to %d\n", baud);
+   log (LOG_INFO, "setting baudrate to %d, buffer size %d\n", baud, rbuf_len);
    io_serial->IOSer.io_Command  = SDCMD_SETPARAMS;
    io_serial->io_Baud           = baud ;
+   io_serial->io_RBufLen        = rbuf_len ;
    if (DoIO( (struct IORequest*) io_serial))
    {
       log (LOG_ERROR, "*** ERROR: failed to set serial parameters!\n");
@@ -262,163 +913,646 @@ static void setup_serial(ULONG baud)
    }
 }
 
-static int read_serial(int len, UBYTE *buf)
+/*
+ * adaptive timeouts: UNIT_MICROHZ time in usecs, wraps every 71 minutes,
+ * so only differences mean something
+ */
+static ULONG clock_usecs(void)
 {
-   ULONG signals;
-   int   todo   = len;
-   int   offset = 0;
-   BOOL  timeout = FALSE;
-
-   while ( !timeout && (todo > 0) )
-   {
-      log(LOG_DEBUG2, "reading %d bytes at off %d from serial port...\n", 
-          todo, offset);
-      io_serial->IOSer.io_Command = CMD_READ;
-      io_serial->IOSer.io_Length  = todo;
-      io_serial->IOSer.io_Data    = (APTR) (buf + offset);
-      SendIO( (struct IORequest*) io_serial);
-
-      io_tr.tr_node.io_Command              = TR_ADDREQUEST;
-      io_tr.tr_node.io_Message.mn_ReplyPort = mp_serial;
-      io_tr.tr_time.tv_secs                 = SERIAL_TIMEOUT_SECS;
-      io_tr.tr_time.tv_micro                = SERIAL_TIMEOUT_MIRCO;
-      SendIO( (struct IORequest*) &io_tr);
-
-      while ( !timeout )
-      {
-         signals = Wait(wait_mask);
-
-         /* CTRL-C ? */
-         if (signals & SIGBREAKF_CTRL_C)
-         {
-            log(LOG_INFO, "CTRL-C detected, aborting.\n");
-            closedown(); 
-         }
-
-         if (CheckIO((struct IORequest*) io_serial))
-         {
-            int len_actual, i;
-            WaitIO((struct IORequest*)io_serial);
-            len_actual = io_serial->IOSer.io_Actual;
-#ifdef DEBUG_BYTES
-            log(LOG_DEBUG2, "%ld bytes received:", len_actual);
-            for (i=offset; (i<len_actual && i<9); i++)
-               log(LOG_DEBUG2, " %02x", buf[i]);
-            log(LOG_DEBUG2, "\n");
-#endif
-
-            todo   -= len_actual;
-            offset += len_actual; 
-
-            AbortIO((struct IORequest*)&io_tr);
-            WaitIO((struct IORequest*)&io_tr);
-
-            break;
-         }
+   io_clock.tr_node.io_Command = TR_GETSYSTIME;
+   DoIO((struct IORequest*) &io_clock);
+   return io_clock.tr_time.tv_secs * 1000000L + io_clock.tr_time.tv_micro;
+}
 
-         if (CheckIO((struct IORequest*) &io_tr))
-         {
-            log (LOG_DEBUG2,"ERR : serial read timeout after %d bytes!\n", offset);
-            WaitIO((struct IORequest*) &io_tr);
+static void timer_post(ULONG usecs)
+{
+   io_tr.tr_node.io_Command              = TR_ADDREQUEST;
+   io_tr.tr_node.io_Message.mn_ReplyPort = mp_serial;
+   io_tr.tr_time.tv_secs                 = usecs / 1000000L;
+   io_tr.tr_time.tv_micro                = usecs % 1000000L;
+   SendIO( (struct IORequest*) &io_tr);
+   tr_armed   = TRUE;
+   tr_expires = tr_deadline;
+}
 
-            AbortIO((struct IORequest*)io_serial);
-            WaitIO((struct IORequest*)io_serial);
+/*
+ * move the deadline to usecs from now. The timer stays posted across
+ * reads, one that goes off too early is simply posted again by
+ * serial_wait(), only a later one has to be aborted.
+ */
+static void timer_arm(ULONG usecs)
+{
+   tr_deadline = clock_usecs() + usecs;
+   if (tr_armed)
+   {
+      if ((LONG) (tr_expires - tr_deadline) <= 0)
+         return;
+      AbortIO((struct IORequest*)&io_tr);
+      WaitIO((struct IORequest*)&io_tr);
+   }
+   timer_post(usecs);
+}
 
-            timeout = TRUE;
+/* Jacobson/Karels: smoothed round trip time plus four deviations */
+static void rto_sample(ULONG usecs)
+{
+   LONG err;
 
-            break;
-         }
-      }
+   if (!rto_srtt)
+   {
+      rto_srtt = usecs;
+      rto_var  = usecs / 2;
    }
-
-   return offset;
+   else
+   {
+      err       = (LONG) usecs - rto_srtt;
+      rto_srtt += err / 8;
+      rto_var  += ((err < 0 ? -err : err) - rto_var) / 4;
+   }
+   rto = rto_srtt + 4 * rto_var;
+   if (rto < RTO_MIN)
+      rto = RTO_MIN;
+   if (rto > RTO_MAX)
+      rto = RTO_MAX;
 }
 
-static void skip_serial_pending(void)
+/* no answer in time: wait twice as long until the next sample */
+static void rto_backoff(void)
 {
+   rto = rto * 2 > RTO_MAX ? RTO_MAX : rto * 2;
+}
 
-   UBYTE scratch[READSIZE];
+static void rto_reset(void)
+{
+   rto_srtt = 0;
+   rto_var  = 0;
+   rto      = SERIAL_TIMEOUT_SECS * 1000000L;
+}
 
-   /* read until serial device is "empty" 
-      (used for re-sync purposes)          */
+/* time allowed for len bytes: the round trip plus sending them */
+static ULONG rx_timeout(int len)
+{
+   if (rx_idle)
+      return SERIAL_TIMEOUT_SECS * 1000000L;
+   return rto + len * (10000000L / baudrate);
+}
 
-   while (1)
+/*
+ * change the rate of a running session, see FTS4_F_BAUD. Round trips
+ * measured at the old rate mean nothing at the new one.
+ */
+static BOOL set_baud(ULONG baud)
+{
+   log (LOG_INFO, "switching to %ld baud\n", baud);
+   io_serial->IOSer.io_Command = SDCMD_SETPARAMS;
+   io_serial->io_Baud          = baud;
+   if (DoIO( (struct IORequest*) io_serial))
    {
-      int i, len_actual=0;
-   
-      len_actual = read_serial(READSIZE, scratch);
-
-      if (len_actual <= 0)
-         break;
+      log (LOG_ERROR, "*** ERROR: %s cannot do %ld baud\n", device_name, baud);
+      io_serial->io_Baud = baudrate;
+      return FALSE;
    }
-
-   log(LOG_DEBUG, "SYNC: skip_serial_pending done.\n");
+   baudrate = baud;
+   rto_reset();
+   return TRUE;
 }
 
-static void write_serial(int len, UBYTE *buf)
+/* can the device do baud? Tried with SDCMD_SETPARAMS, the rate stays as it is */
+static BOOL baud_ok(ULONG baud)
 {
-   ULONG signals;
-
-   log (LOG_DEBUG2, "sending %d bytes to serial port...\n", len);
-   io_serial->IOSer.io_Command = CMD_WRITE;
-   io_serial->IOSer.io_Length  = len;
-   io_serial->IOSer.io_Data    = (APTR)buf;
-   SendIO( (struct IORequest*) io_serial);
+   io_serial->IOSer.io_Command = SDCMD_SETPARAMS;
+   io_serial->io_Baud          = baud;
+   if (DoIO( (struct IORequest*) io_serial))
+   {
+      log (LOG_ERROR, "*** ERROR: %s cannot do %ld baud\n", device_name, baud);
+      io_serial->io_Baud = baudrate;
+      return FALSE;
+   }
+   io_serial->IOSer.io_Command = SDCMD_SETPARAMS;
+   io_serial->io_Baud          = baudrate;
+   DoIO( (struct IORequest*) io_serial);
+   return TRUE;
+}
 
-   while ( 1 )
+/*
+ * wait for io to complete (TRUE) or, if timed, for the deadline to pass
+ * first (FALSE, io is aborted then). CTRL-C aborts the program.
+ */
+static BOOL serial_wait(struct IORequest *io, BOOL timed)
+{
+   while (TRUE)
    {
-      signals = Wait(wait_mask);
+      ULONG signals;
 
-      /* CTRL-C ? */
-      if (signals & SIGBREAKF_CTRL_C)
+      if (CheckIO(io))
       {
-         log (LOG_INFO, "CTRL-C detected, aborting.\n");
-         closedown(); 
+         WaitIO(io);
+         return TRUE;
       }
 
-      if (CheckIO((struct IORequest*) io_serial))
+      if (timed && tr_armed && CheckIO((struct IORequest*) &io_tr))
       {
-         int len_actual;
-         WaitIO((struct IORequest*)io_serial);
-         len_actual = io_serial->IOSer.io_Actual;
-         log (LOG_DEBUG2, "%ld bytes sent: %02x%02x%02x%02x.\n", 
-              len_actual,
-              buf[0], buf[1], buf[2],
-              buf[3]);
-         if (len_actual != len) 
+         LONG left;
+
+         WaitIO((struct IORequest*) &io_tr);
+         tr_armed = FALSE;
+
+         left = tr_deadline - clock_usecs();
+         if (left > 0)
          {
-            log (LOG_ERROR, 
-                 "*** ERROR: sent %d bytes to serial port, expected %d\n",
-                 len_actual, len);
-            closedown();
+            timer_post(left);
+            continue;
          }
-         break;
+         AbortIO(io);
+         WaitIO(io);
+         return FALSE;
+      }
+
+      signals = Wait(wait_mask);
+
+      /* CTRL-C ? */
+      if (signals & SIGBREAKF_CTRL_C)
+      {
+         log(LOG_INFO, "CTRL-C detected, aborting.\n");
+         closedown(); 
       }
    }
 }
 
-static void write_ack(void)
+/* bytes serial.device has received for us */
+static ULONG serial_query(void)
 {
-   log (LOG_DEBUG, "ACK\n");
-   write_serial(4, (UBYTE*) "PkOk");
+   io_serial->IOSer.io_Command = SDCMD_QUERY;
+   DoIO( (struct IORequest*) io_serial);
+   serial_ios++;
+   return io_serial->IOSer.io_Actual;
 }
 
-static void write_nack(void)
+/* bytes read_serial() can return without waiting */
+static ULONG serial_avail(void)
 {
-   log (LOG_DEBUG, "NACK\n");
-   write_serial(4, (UBYTE*) "PkRs");
+   ULONG n = serial_query();
+
+   if (n)
+      rx_asked = FALSE;
+   return (rx_len - rx_pos) + n;
 }
 
-static void read_message(struct ax_header *header, UBYTE *payload, int max_len)
+/* CMD_READ of bytes the device has already, returns at once */
+static int rx_read(UBYTE *buf, int len)
 {
-   while (TRUE)
-   {
-      ULONG crc2;
-      int len_actual;
-
-      /* header */
+   io_serial_rd->IOSer.io_Command = CMD_READ;
+   io_serial_rd->IOSer.io_Length  = len;
+   io_serial_rd->IOSer.io_Data    = (APTR) buf;
+   DoIO( (struct IORequest*) io_serial_rd);
+   serial_ios++;
+
+   len           = io_serial_rd->IOSer.io_Actual;
+   serial_bytes += len;
+   return len;
+}
 
-      len_actual = read_serial(12, (UBYTE *) header);
+/*
+ * up to need bytes without waiting: what rxbuf holds, else, if the device
+ * has all of them already, everything it has in a single quick CMD_READ.
+ * Big reads go straight to buf, the rest of a small one stays in rxbuf,
+ * so the header or ack behind it costs no request at all. Anything less
+ * is left to one CMD_READ we wait for.
+ */
+static int rx_take(UBYTE *buf, int need)
+{
+   int l = rx_len - rx_pos;
+
+   if (!l)
+   {
+      ULONG n;
+
+      if (rx_asked)
+         return 0;
+      n = serial_query();
+      if (n < need)
+         return 0;
+      if (need >= RXBUF_SIZE)
+         return rx_read(buf, need);
+
+      rx_pos = 0;
+      rx_len = rx_read(rxbuf, n < RXBUF_SIZE ? (int) n : RXBUF_SIZE);
+      l      = rx_len;
+   }
+   if (l > need)
+      l = need;
+   CopyMem(rxbuf + rx_pos, buf, l);
+   rx_pos += l;
+   return l;
+}
+
+/*
+ * post the read for the next frame header without waiting for it, so
+ * serial.device receives it while we are busy writing to disk.
+ * read_message() picks it up.
+ */
+static void prefetch_header(void)
+{
+   if (rd_prefetched || (rx_pos < rx_len))
+      return;
+
+   io_serial_rd->IOSer.io_Command = CMD_READ;
+   io_serial_rd->IOSer.io_Length  = sizeof(struct ax_header);
+   io_serial_rd->IOSer.io_Data    = (APTR) &rx_header;
+   SendIO( (struct IORequest*) io_serial_rd);
+   serial_ios++;
+   serial_waits++;
+
+   rd_prefetched = TRUE;
+}
+
+/*
+ * read len bytes into buf, gives up after rx_timeout() of silence. Only
+ * waits for what rx_take() cannot deliver right away.
+ * if crc is not NULL, every chunk received is folded into *crc
+ * (see crc32_update()) while the device is busy fetching the next one.
+ */
+static int read_serial(int len, UBYTE *buf, ULONG *crc)
+{
+   int   offset   = 0;
+   int   crc_done = 0;
+   BOOL  posted   = FALSE;
+
+   if (rd_prefetched)
+   {
+      rd_prefetched = FALSE;
+      if (buf == (UBYTE *) &rx_header)
+         posted = TRUE;
+      else
+      {
+         log(LOG_ERROR, "*** ERROR: prefetched read not picked up!\n");
+         AbortIO((struct IORequest*)io_serial_rd);
+         WaitIO((struct IORequest*)io_serial_rd);
+      }
+   }
+
+   while (offset < len)
+   {
+      int  len_actual;
+      BOOL done;
+
+      if (!posted)
+      {
+         offset += rx_take(buf + offset, len - offset);
+         if (offset == len)
+            break;
+
+         log(LOG_DEBUG2, "reading %d bytes at off %d from serial port...\n", 
+             len - offset, offset);
+         io_serial_rd->IOSer.io_Command = CMD_READ;
+         io_serial_rd->IOSer.io_Length  = len - offset;
+         io_serial_rd->IOSer.io_Data    = (APTR) (buf + offset);
+         SendIO( (struct IORequest*) io_serial_rd);
+         serial_ios++;
+         serial_waits++;
+      }
+      posted = FALSE;
+
+      timer_arm(rx_timeout(len - offset));
+      rx_idle = FALSE;   /* the rest of a message has to come in time */
+
+      if (crc && (crc_done < offset))
+      {
+         *crc = crc32_update(*crc, buf + crc_done, offset - crc_done);
+         crc_done = offset;
+      }
+
+      done       = serial_wait((struct IORequest*) io_serial_rd, TRUE);
+      len_actual = io_serial_rd->IOSer.io_Actual;
+      rx_asked   = FALSE;
+
+#ifdef DEBUG_BYTES
+      {
+         int i;
+         log(LOG_DEBUG2, "%ld bytes received:", len_actual);
+         for (i=offset; (i<offset+len_actual && i<offset+9); i++)
+            log(LOG_DEBUG2, " %02x", buf[i]);
+         log(LOG_DEBUG2, "\n");
+      }
+#endif
+
+      offset       += len_actual;
+      serial_bytes += len_actual;
+
+      /* the timer only means silence if nothing came in meanwhile */
+      if (!done && !len_actual)
+      {
+         log (LOG_DEBUG2,"ERR : serial read timeout after %d bytes!\n", offset);
+         break;
+      }
+   }
+
+   if (crc && (crc_done < offset))
+      *crc = crc32_update(*crc, buf + crc_done, offset - crc_done);
+
+   return offset;
+}
+
+/*
+ * write_serial() in two halves, so we can do something useful while the
+ * bytes go out. buf must not be touched before write_serial_wait().
+ */
+static void write_serial_post(int len, UBYTE *buf)
+{
+   log (LOG_DEBUG2, "sending %d bytes to serial port...\n", len);
+   io_serial->IOSer.io_Command = CMD_WRITE;
+   io_serial->IOSer.io_Length  = len;
+   io_serial->IOSer.io_Data    = (APTR)buf;
+   SendIO( (struct IORequest*) io_serial);
+   serial_ios++;
+   serial_waits++;
+   serial_bytes += len;
+   rx_asked      = TRUE;
+}
+
+static void write_serial_wait(int len, UBYTE *buf)
+{
+   int len_actual;
+
+   serial_wait((struct IORequest*) io_serial, FALSE);
+
+   len_actual = io_serial->IOSer.io_Actual;
+   log (LOG_DEBUG2, "%ld bytes sent: %02x%02x%02x%02x.\n", 
+        len_actual,
+        buf[0], buf[1], buf[2],
+        buf[3]);
+   if (len_actual != len) 
+   {
+      log (LOG_ERROR, 
+           "*** ERROR: sent %d bytes to serial port, expected %d\n",
+           len_actual, len);
+      closedown();
+   }
+}
+
+static void write_serial(int len, UBYTE *buf)
+{
+   write_serial_post(len, buf);
+   write_serial_wait(len, buf);
+}
+
+/* throw away what the device has buffered, without waiting for more */
+static void drain_serial(void)
+{
+   UBYTE scratch[READSIZE];
+   ULONG n;
+
+   rx_dropped += rx_len - rx_pos;
+   rx_pos      = 0;
+   rx_len      = 0;
+
+   while ((n = serial_query()) > 0)
+   {
+      if (n > READSIZE)
+         n = READSIZE;
+      rx_dropped += read_serial((int) n, scratch, NULL);
+   }
+   log(LOG_DEBUG, "SYNC: drained, %ld bytes dropped\n", rx_dropped);
+}
+
+/*
+ * after a corrupted header: slide a 12 byte window over the input until
+ * it holds a header with sync byte and CRC intact, so we lose a few byte
+ * times instead of waiting for a second of silence. FALSE if the line
+ * went quiet first.
+ */
+static BOOL resync_header(void)
+{
+   UBYTE *w    = (UBYTE *) &rx_header;
+   int    have = 12;
+
+   while (TRUE)
+   {
+      int i, j;
+
+      /* drop the first byte and everything up to the next sync byte */
+      for (i=1; (i<have) && w[i]; i++)
+         ;
+      for (j=i; j<have; j++)
+         w[j-i] = w[j];
+      have       -= i;
+      rx_dropped += i;
+
+      have += read_serial(12-have, w+have, NULL);
+      if (have < 12)
+      {
+         rx_dropped += have;
+         return FALSE;
+      }
+      if (!rx_header.sync && (crc32(w, 8) == rx_header.crc))
+      {
+         log(LOG_DEBUG, "SYNC: header found, %ld bytes dropped\n", rx_dropped);
+         return TRUE;
+      }
+   }
+}
+
+/* device I/O requests per MB moved since the last call */
+static void log_serial_ios(void)
+{
+   if (serial_bytes >= 1024)
+      log(LOG_INFO, "serial: %ld I/O requests (%ld waited for) for %ld bytes, %ld per MB\n",
+          serial_ios, serial_waits, serial_bytes, serial_ios * 1024 / (serial_bytes >> 10));
+   serial_ios   = 0;
+   serial_waits = 0;
+   serial_bytes = 0;
+
+   if (lz_blocks)
+      log(LOG_INFO, "compression: %ld data bytes in %ld wire bytes, %ld of %ld blocks raw\n",
+          lz_data, lz_wire, lz_raw, lz_blocks);
+   lz_data   = 0;
+   lz_wire   = 0;
+   lz_blocks = 0;
+   lz_raw    = 0;
+
+   if (rto_srtt)
+      log(LOG_INFO, "timeout: round trip %ld us +- %ld, %ld us\n",
+          rto_srtt, rto_var, rto);
+
+   if (rx_bad)
+      log(LOG_INFO, "resync: %ld corrupted headers, %ld bytes dropped, %ld per error\n",
+          rx_bad, rx_dropped, rx_dropped / rx_bad);
+   rx_bad     = 0;
+   rx_dropped = 0;
+
+   if (session_parity)
+      log(LOG_INFO, "fec: %ld frames repaired (%ld bytes), %ld beyond repair, %ld resent\n",
+          fec_fixed, fec_bytes, fec_failed, tx_resent);
+   fec_fixed  = 0;
+   fec_bytes  = 0;
+   fec_failed = 0;
+   tx_resent  = 0;
+}
+
+static void write_ack(void)
+{
+   if (rx_stream)
+   {
+      ULONG ack[2];
+
+      ack[0] = ACK_OK;
+      ack[1] = rx_seq-1;
+      log (LOG_DEBUG, "ACK %d\n", ack[1]);
+      write_serial(8, (UBYTE*) ack);
+      return;
+   }
+   log (LOG_DEBUG, "ACK\n");
+   write_serial(4, (UBYTE*) "PkOk");
+}
+
+static void write_nack(void)
+{
+   if (rx_stream)
+   {
+      ULONG ack[2];
+
+      ack[0] = ACK_RESEND;
+      ack[1] = rx_seq;
+      log (LOG_DEBUG, "NACK %d\n", ack[1]);
+      write_serial(8, (UBYTE*) ack);
+      return;
+   }
+   log (LOG_DEBUG, "NACK\n");
+   write_serial(4, (UBYTE*) "PkRs");
+}
+
+/*
+ * line quality: a rolling estimate of frame errors per byte, the history
+ * is halved whenever it exceeds LINK_WINDOW bytes.
+ */
+static void link_good(LONG len)
+{
+   link_bytes += len + BLOCK_OVERHEAD;
+   if (link_bytes > LINK_WINDOW)
+   {
+      link_bytes  /= 2;
+      link_errors /= 2;
+   }
+}
+
+static void link_error(LONG len)
+{
+   link_errors += 256;
+   link_good(len);
+}
+
+static void link_reset(void)
+{
+   link_bytes     = LINK_WINDOW / 2;  /* assume a clean line to start with */
+   link_errors    = 0;
+   link_blocksize = session_blocksize;
+}
+
+/* errors per megabyte, for the log */
+static ULONG link_error_rate(void)
+{
+   return link_errors * 16 / ((link_bytes >> 8) + 1);
+}
+
+static ULONG isqrt(ULONG x)
+{
+   ULONG r = 0, bit = 1L << 30;
+
+   while (bit > x)
+      bit >>= 2;
+   while (bit)
+   {
+      if (x >= r + bit)
+      {
+         x -= r + bit;
+         r  = (r >> 1) + bit;
+      }
+      else
+         r >>= 1;
+      bit >>= 2;
+   }
+   return r;
+}
+
+/*
+ * size of the next block we send. Goodput B/(B+H) * (1-e)^(B+H) for an
+ * error rate of e per byte and a per frame cost of H peaks near
+ * B = sqrt(H/e); we use the largest power of two below that. A clean
+ * line gets the negotiated size as it is.
+ */
+static LONG tx_blocksize(BOOL dir)
+{
+   ULONG target;
+   LONG  bs;
+
+   if (!(session_flags & FTS4_F_BLOCKSIZE))
+      return dir ? BUFSIZE-4 : READSIZE;
+
+   if (link_errors)
+   {
+      target = isqrt(BLOCK_COST * link_bytes / link_errors * 256);
+
+      bs = MIN_BLOCKSIZE;
+      while ( (bs*2 <= target) && (bs*2 <= session_blocksize) )
+         bs *= 2;
+   }
+   else
+      bs = session_blocksize;
+
+   if (bs != link_blocksize)
+   {
+      log (LOG_DEBUG, "blocksize %d -> %d (%d errors/MB)\n",
+           link_blocksize, bs, link_error_rate());
+      link_blocksize = bs;
+   }
+   return bs;
+}
+
+/* MSG_BLOCK payloads with FTS4_F_FEC parity behind them */
+static BOOL fec_frame(struct ax_header *header)
+{
+   return session_parity &&
+          ((header->msg == MSG_BLOCK) || (header->msg == MSG_BLOCK_LZ));
+}
+
+/* a frame that failed its CRC, TRUE if the parity could repair it */
+static BOOL fec_repair(struct ax_header *header, UBYTE *payload, ULONG crc1)
+{
+   LONG n = fec_data(header->len, session_parity);
+   LONG r;
+
+   r = fec_decode(payload, n, payload + n, session_parity);
+   if ((r > 0) && (crc32(payload, header->len) == crc1))
+   {
+      log (LOG_DEBUG, "FEC : %ld bytes corrected\n", r);
+      fec_fixed++;
+      fec_bytes += r;
+      return TRUE;
+   }
+   fec_failed++;
+   return FALSE;
+}
+
+static void read_message(struct ax_header *header, UBYTE *payload, int max_len)
+{
+   BOOL resynced = FALSE;
+
+   while (TRUE)
+   {
+      ULONG crc2;
+      int len_actual;
+
+      /* header (may have been prefetched, or found by resync_header()) */
+
+      if (resynced)
+         len_actual = 12;
+      else
+      {
+         rx_idle    = TRUE;
+         len_actual = read_serial(12, (UBYTE *) &rx_header, NULL);
+      }
+      resynced = FALSE;
+      *header  = rx_header;
 
       if (len_actual == 0)
          continue;
@@ -431,11 +1565,31 @@ static void read_message(struct ax_header *header, UBYTE *payload, int max_len)
       if ( (len_actual != 12) || (header->crc != crc2) )
       {
          log (LOG_ERROR, "ERR : corrupted message header\n");
-         skip_serial_pending(); /* skip payload, if any */
-         write_nack();
+         link_error(0);
+         rx_bad++;
+         if (!rx_nacked)
+            write_nack();
+         rx_nacked = rx_stream;
+
+         /* a client that starts over talks at the -b rate */
+         if ((++rx_bad_run >= BAUD_BAD_RUN) && (baudrate != baud_start))
+         {
+            log (LOG_INFO, "%d corrupted headers in a row\n", rx_bad_run);
+            drain_serial();
+            set_baud(baud_start);
+            rx_bad_run = 0;
+            continue;
+         }
+
+         /* a short header means the line is quiet already */
+         if (len_actual == 12)
+            resynced = resync_header();
+         else
+            rx_dropped += len_actual;
          continue;
       }
-      /* FIXME: check sequence! */
+
+      rx_bad_run = 0;
 
       /* payload, if any */
 
@@ -448,499 +1602,2691 @@ static void read_message(struct ax_header *header, UBYTE *payload, int max_len)
 	         header->len, max_len);
 	    closedown();
 	 }
-         len_actual = read_serial(header->len, payload);
-         read_serial(4, (UBYTE *) &crc1);
-         crc2 = crc32(payload, header->len);
+         crc2 = crc32_init();
+         len_actual = read_serial(header->len, payload, &crc2);
+         read_serial(4, (UBYTE *) &crc1, NULL);
+         crc2 = crc32_final(crc2);
+         if ( (len_actual == header->len) && (crc1 != crc2) &&
+              fec_frame(header) && fec_repair(header, payload, crc1) )
+            crc2 = crc1;
          if ( (len_actual != header->len) || (crc1 != crc2) )
          {
             log (LOG_ERROR, "ERR : corrupted payload data (CRC: %08x vs %08x, len: %d vs %d)\n",
                  crc1, crc2, len_actual, header->len);
-            write_nack();
+            link_error(header->len);
+            if (!rx_nacked)
+               write_nack();
+            rx_nacked = rx_stream;
             continue;
          }
       }
+      link_good(header->len);
+      if (fec_frame(header))
+         header->len = fec_data(header->len, session_parity);
+
+      /* stream frames have to arrive in order (go-back-n) */
+      if (rx_stream && (header->seq != rx_seq))
+      {
+         log (LOG_DEBUG, "SEQ : got %d, expected %d\n", header->seq, rx_seq);
+         if ((LONG) (header->seq - rx_seq) < 0)
+            write_ack();          /* duplicate, our ack got lost */
+         else if (!rx_nacked)
+         {
+            write_nack();
+            rx_nacked = TRUE;
+         }
+         continue;
+      }
+
+      /* late retransmission of a stream we already completed */
+      if (!rx_stream && (session_flags & FTS4_F_WINDOW) &&
+          ((header->msg == MSG_BLOCK) || (header->msg == MSG_BLOCK_LZ) ||
+           (header->msg == MSG_EOF)) &&
+          ((LONG) (header->seq - rx_seq) < 0))
+      {
+         log (LOG_DEBUG, "SEQ : stale stream frame %d\n", header->seq);
+         rx_stream = TRUE;
+         write_ack();
+         rx_stream = FALSE;
+         continue;
+      }
       break;
    }
+   rx_seq    = header->seq + 1;
+   rx_nacked = FALSE;
    write_ack();
 }
 
-static ULONG read_ack(void)
+/* append name to path, -1 if it does not fit, else the old length */
+static int path_add(char *path, char *name)
 {
-   ULONG ack = 0xDEADBEEF;
-   read_serial(4, (UBYTE*) &ack);
-   return ack;
+   int l = strlen(path);
+
+   if (l + strlen(name) + 2 > PATH_MAX)
+      return -1;
+   if (l && (path[l-1] != ':') && (path[l-1] != '/'))
+      strcat(path, "/");
+   strcat(path, name);
+   return l;
 }
 
-static void write_message(WORD msg, UBYTE *payload, int len)
+static char *path_base(char *path)
 {
-   static ULONG seq = 0;
-   struct ax_header header;
+   char *p = path + strlen(path);
 
-   header.sync = 0;
-   header.msg  = msg;
-   header.len  = len;
-   header.seq  = seq++;
-   header.crc  = crc32((UBYTE*)&header, 8);
+   while ((p > path) && (p[-1] != ':') && (p[-1] != '/'))
+      p--;
+   return p;
+}
 
-   log (LOG_DEBUG, "WMSG: cmd=0x%02x len=%d seq=%d crc=%08x\n",
-        header.msg, header.len, header.seq, header.crc);
+/*
+ * download read-ahead: the file is read in iobuf sized chunks, MSG_BLOCK
+ * payloads are then copied out of iobuf. Uploads use it the other way
+ * round, see msg_block().
+ */
+static void free_iobuf(void)
+{
+   if (iobuf)
+      FreeMem(iobuf, iobuf_size);
+   iobuf      = NULL;
+   iobuf_size = 0;
+}
 
-   while (TRUE)
-   {
-      ULONG ack;
+/* as big as free memory comfortably allows, NULL if that is too little */
+static UBYTE *alloc_big(LONG *size)
+{
+   UBYTE *b = NULL;
+   LONG   l = IOBUF_MAX;
 
-      write_serial(12, (UBYTE*) &header);
+   while ((l >= IOBUF_MIN) && (AvailMem(MEMF_LARGEST) < 4 * l))
+      l /= 2;
 
-      /* payload, if any */
-      if (len)
-      {
-         ULONG crc1;
-         write_serial(len, payload);
-         crc1 = crc32(payload, len);
-         write_serial(4, (UBYTE*) &crc1);
-      }
+   while ((l >= IOBUF_MIN) && !(b = AllocMem(l, 0)))
+      l /= 2;
 
-      ack = read_ack();
-      if (ack != 0x506b4f6b /* PkOk */)
-      {
-         log (LOG_ERROR, "ERR : read_ack failed! (got: 0x%08x)\n", ack);
-         if (ack == 0x506b5273) /* PkRs */
-         {
-            skip_serial_pending();
-            continue;
-         }
-      }
-      break;
-   }
+   *size = b ? l : 0;
+   return b;
 }
 
-static void msg_recv (UBYTE *recv_buf, WORD recv_len)
+static void alloc_iobuf(void)
 {
-   struct Lock     *file_lock;
-   struct InfoData *file_info;
+   if (iobuf)
+      return;
 
-   recv = *( (struct ax_recv *)recv_buf );
-   strncpy (filename, (char *)recv_buf+29, PATH_MAX);
-   filename[PATH_MAX-1] = 0;
+   iobuf = alloc_big(&iobuf_size);
+   log(LOG_DEBUG, "alloc_iobuf: %d bytes\n", iobuf_size);
+}
 
-   log(LOG_DEBUG, "msg_recv %s size=%d attrs=0x%08x date=%d time=%d ctime=%d len=%d\n",
-       filename, recv.file_size,
-       recv.attrs, recv.date, recv.time, recv.ctime, recv.len);
+/* (re-)fill iobuf with the file starting at pos, keep what we have of it */
+static void ra_fill(ULONG pos)
+{
+   ULONG end  = iobuf_pos + ra_len;
+   LONG  keep = 0;
+   LONG  l;
 
-   /* does this file exist ? */
+   if ((pos >= iobuf_pos) && (pos < end))
+   {
+      UBYTE *src = iobuf + (pos - iobuf_pos);
+      LONG   i;
 
-   file_lock = (struct Lock *) Lock (filename, ACCESS_READ);
-   if (file_lock)
+      keep = end - pos;
+      for (i=0; i<keep; i++)     /* overlapping, CopyMem() won't do */
+         iobuf[i] = src[i];
+   }
+   else if (pos != io_file_pos)
    {
-      write_message (MSG_IOERR, NULL, 0);
-      UnLock ((BPTR)file_lock);
-   } 
-   else
-   {    
-      /* are we creating a directory here ? */
+      Seek((BPTR)io_file, pos, OFFSET_BEGINNING);
+      io_file_pos = pos;
+   }
 
-      if (recv.file_type == AX_FILE_TYPE_DIR)
-      {
-         if (lock)
-         {
-            UnLock((BPTR) lock);
+   l = Read((BPTR)io_file, (char*) iobuf + keep, iobuf_size - keep);
+   if (l < 0)
+   {
+      log(LOG_ERROR, "*** ERROR: read failed at pos %d: %s\n", io_file_pos, filename);
+      l = 0;
+   }
+
+   iobuf_pos       = pos;
+   ra_len       = keep + l;
+   ra_eof       = l < iobuf_size - keep;
+   io_file_pos += l;
+
+   log(LOG_DEBUG, "ra_fill pos=%d len=%d eof=%d\n", iobuf_pos, ra_len, ra_eof);
+}
+
+/* write len bytes at file offset pos, errors are reported at MSG_FILE_CLOSE */
+static void write_file(ULONG pos, UBYTE *buf, LONG len)
+{
+   if (pos != io_file_pos)
+      Seek((BPTR)io_file, pos, OFFSET_BEGINNING);
+
+   if (Write((BPTR)io_file, (char*) buf, len) != len)
+   {
+      log(LOG_ERROR, "*** ERROR: write failed at pos %d: %s\n", pos, filename);
+      io_write_failed = TRUE;
+      io_file_pos     = (ULONG) -1;
+      return;
+   }
+   io_file_pos = pos + len;
+}
+
+static void flush_iobuf(void)
+{
+   if (!wb_len)
+      return;
+
+   log(LOG_DEBUG, "flush_iobuf pos=%d len=%d\n", iobuf_pos, wb_len);
+   write_file(iobuf_pos, iobuf, wb_len);
+   wb_len = 0;
+}
+
+/* append len bytes to a file written sequentially (delta, batch) */
+static void wb_append(UBYTE *buf, LONG len)
+{
+   if (!iobuf)
+   {
+      write_file(wb_out, buf, len);
+      wb_out += len;
+      return;
+   }
+
+   while (len > 0)
+   {
+      LONG l = iobuf_size - wb_len;
+
+      if (l > len)
+         l = len;
+      if (!wb_len)
+         iobuf_pos = wb_out;
+      CopyMem(buf, iobuf + wb_len, l);
+      wb_len += l;
+      wb_out += l;
+      buf    += l;
+      len    -= l;
+      if (wb_len == iobuf_size)
+         flush_iobuf();
+   }
+}
+
+/* append count blocks of the old file, read straight into iobuf */
+static void delta_copy(ULONG block, ULONG count)
+{
+   ULONG pos = block * delta_bs;
+   ULONG len = count * delta_bs;
+
+   log(LOG_DEBUG2, "delta_copy block=%d count=%d\n", block, count);
+
+   if (pos != delta_old_pos)
+      Seek((BPTR)delta_old, pos, OFFSET_BEGINNING);
+   delta_old_pos = pos;
+
+   while (len > 0)
+   {
+      LONG l = iobuf_size - wb_len;
+
+      if (l > len)
+         l = len;
+      if (!wb_len)
+         iobuf_pos = wb_out;
+      l = Read((BPTR)delta_old, (char*) iobuf + wb_len, l);
+      if (l <= 0)
+      {
+         if (l < 0)
+            delta_old_pos = (ULONG) -1;
+         break;   /* the last block may be short */
+      }
+      wb_len        += l;
+      wb_out        += l;
+      delta_old_pos += l;
+      len           -= l;
+      if (wb_len == iobuf_size)
+         flush_iobuf();
+   }
+}
+
+/* run the instructions in a MSG_BLOCK payload of a delta upload */
+static void delta_apply(ULONG pos, UBYTE *buf, LONG len)
+{
+   if (pos != delta_pos)
+   {
+      if (pos > delta_pos)
+      {
+         log(LOG_ERROR, "*** ERROR: delta stream gap at %d (expected %d)\n",
+             pos, delta_pos);
+         io_write_failed = TRUE;
+      }
+      return;   /* duplicate */
+   }
+   delta_pos += len;
+
+   while (len > 0)
+   {
+      if (delta_lit)
+      {
+         LONG l = delta_lit < len ? delta_lit : len;
+
+         wb_append(buf, l);
+         delta_lit -= l;
+         buf       += l;
+         len       -= l;
+         continue;
+      }
+
+      delta_op[delta_op_len++] = *buf++;
+      len--;
+
+      if (delta_op_len == 4)
+      {
+         ULONG op;
+
+         CopyMem(delta_op, &op, 4);
+         if (op & DELTA_LITERAL)
+         {
+            delta_lit    = op & ~DELTA_LITERAL;
+            delta_op_len = 0;
+         }
+      }
+      else if (delta_op_len == 8)
+      {
+         ULONG op[2];
+
+         CopyMem(delta_op, op, 8);
+         delta_copy(op[0], op[1]);
+         delta_op_len = 0;
+      }
+   }
+}
+
+static void delta_drop(void)
+{
+   if (delta_old)
+      Close((BPTR)delta_old);
+   delta_old = NULL;
+}
+
+/*
+ * name with suffix behind it, in the same directory. The name is cut
+ * short if the result would not fit a file name. FALSE if the path is
+ * too long or something of that name is already there.
+ */
+static BOOL delta_name(char *dst, char *name, char *suffix)
+{
+   char *base;
+   BPTR  l;
+
+   if (strlen(name) + strlen(suffix) >= PATH_MAX)
+      return FALSE;
+
+   strcpy(dst, name);
+   base = path_base(dst);
+   if (strlen(base) + strlen(suffix) > DOS_NAME_MAX)
+      base[DOS_NAME_MAX - strlen(suffix)] = 0;
+   strcat(dst, suffix);
+
+   l = Lock(dst, ACCESS_READ);
+   if (l)
+   {
+      UnLock(l);
+      log(LOG_ERROR, "ERR  %s is in the way\n", dst);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/*
+ * delta upload done: replace the old file with the new one, or throw the
+ * new one away if anything went wrong. The old file is only renamed
+ * aside until the new one is in place, and put back if that fails.
+ */
+static void delta_finish(void)
+{
+   delta_drop();
+
+   if (!io_write_failed && ((wb_out != delta_size) || delta_lit || delta_op_len))
+   {
+      log(LOG_ERROR, "*** ERROR: delta for %s incomplete: %d of %d bytes\n",
+          filename, wb_out, delta_size);
+      io_write_failed = TRUE;
+   }
+   if (io_write_failed)
+   {
+      DeleteFile(delta_tmp);
+      return;
+   }
+
+   if (!delta_name(delta_bak, filename, DELTA_OLD) || !Rename(filename, delta_bak))
+   {
+      log(LOG_ERROR, "ERR  cannot replace %s, error %d\n", filename, IoErr());
+      io_write_failed = TRUE;
+      DeleteFile(delta_tmp);
+      return;
+   }
+   if (!Rename(delta_tmp, filename))
+   {
+      log(LOG_ERROR, "ERR  cannot rename %s to %s, error %d\n",
+          delta_tmp, filename, IoErr());
+      io_write_failed = TRUE;
+      if (Rename(delta_bak, filename))
+         DeleteFile(delta_tmp);
+      else
+         log(LOG_ERROR, "ERR  old version of %s left as %s\n", filename, delta_bak);
+      return;
+   }
+   if (!DeleteFile(delta_bak) && 
+       !(SetProtection(delta_bak, 0) && DeleteFile(delta_bak)))
+      log(LOG_ERROR, "ERR  cannot delete %s, error %d\n", delta_bak, IoErr());
+   log(LOG_DEBUG, "delta_finish %s: %d bytes from %d delta bytes\n",
+       filename, wb_out, delta_pos);
+}
+
+/* the entry header is complete: create the directory or open the file */
+static void batch_start(void)
+{
+   char        *name = (char*) batch_hdr + sizeof(batch_e), *p;
+   struct Lock *l;
+
+   batch_hdr[batch_e.len-1] = 0;
+   batch_comment = name + strlen(name) + 1;
+   if (batch_comment >= (char*) batch_hdr + batch_e.len)
+      batch_comment--;   /* no room left for one */
+
+   batch_ok = FALSE;
+   batch_path[batch_base] = 0;
+
+   /* a volume, a leading or a double / would lead out of the target */
+   for (p = name; *p; p++)
+      if ((*p == ':') || ((*p == '/') && ((p == name) || (p[-1] == '/'))))
+         break;
+   if (!*name || *p)
+   {
+      log(LOG_ERROR, "ERR  batch: bad name: %s\n", name);
+      return;
+   }
+   if (path_add(batch_path, name) < 0)
+   {
+      log(LOG_ERROR, "ERR  batch: path too long: %s\n", name);
+      return;
+   }
+
+   log(LOG_DEBUG, "batch %s size=%d type=%d\n", batch_path, batch_e.size, batch_e.type);
+
+   l = (struct Lock *) Lock(batch_path, ACCESS_READ);
+   if (batch_e.type == AX_FILE_TYPE_DIR)
+   {
+      if (!l)
+         l = (struct Lock *) CreateDir(batch_path);
+      if (!l)
+      {
+         log(LOG_ERROR, "ERR  makedir(%s) failed, error %d\n", batch_path, IoErr());
+         return;
+      }
+      UnLock((BPTR) l);
+      batch_ok = TRUE;
+      return;
+   }
+
+   if (l)
+   {
+      log(LOG_ERROR, "ERR  %s exists\n", batch_path);
+      UnLock((BPTR) l);
+      return;
+   }
+
+   io_file = (struct FileHandle *) Open(batch_path, MODE_NEWFILE);
+   if (!io_file)
+   {
+      log(LOG_ERROR, "ERR  cannot create %s, error %d\n", batch_path, IoErr());
+      return;
+   }
+   io_file_pos = 0;
+   wb_out      = 0;
+   batch_ok    = TRUE;
+}
+
+/* the entry is complete: close it, set its attributes */
+static void batch_done(void)
+{
+   batch_hdr_len = 0;
+
+   if (io_file)
+   {
+      flush_iobuf();
+      Close((BPTR) io_file);
+      io_file = NULL;
+      if (io_write_failed)
+      {
+         io_write_failed = FALSE;
+         batch_ok        = FALSE;
+         DeleteFile(batch_path);
+      }
+   }
+   if (!batch_ok)
+   {
+      batch_failed++;
+      return;
+   }
+
+   SetProtection(batch_path, batch_e.attrs);
+   if (*batch_comment)
+      SetComment(batch_path, batch_comment);
+   if (DOSBase->dl_lib.lib_Version >= 36)
+   {
+      struct DateStamp ds;
+      ds.ds_Days   = batch_e.date;
+      ds.ds_Minute = batch_e.time;
+      ds.ds_Tick   = 0;
+      SetFileDate(batch_path, &ds);
+   }
+   batch_files++;
+}
+
+/* unpack the entries in a MSG_BLOCK payload of a batch */
+static void batch_apply(ULONG pos, UBYTE *buf, LONG len)
+{
+   if (pos != batch_pos)
+   {
+      if (pos > batch_pos)
+      {
+         log(LOG_ERROR, "*** ERROR: batch stream gap at %d (expected %d)\n",
+             pos, batch_pos);
+         batch_failed++;
+         batch_pos = (ULONG) -1;   /* ignore the rest */
+      }
+      return;   /* duplicate */
+   }
+   batch_pos += len;
+
+   while (len > 0)
+   {
+      LONG l;
+
+      if (batch_left)
+      {
+         l = batch_left < len ? batch_left : len;
+         if (io_file)
+            wb_append(buf, l);
+         batch_left -= l;
+         buf        += l;
+         len        -= l;
+         if (!batch_left)
+            batch_done();
+         continue;
+      }
+
+      /* the fixed part of an entry first, it holds the length of the rest */
+      l = (batch_hdr_len < sizeof(batch_e) ? sizeof(batch_e) : batch_e.len) - batch_hdr_len;
+      if (l > len)
+         l = len;
+      CopyMem(buf, batch_hdr + batch_hdr_len, l);
+      batch_hdr_len += l;
+      buf           += l;
+      len           -= l;
+
+      if (batch_hdr_len == sizeof(batch_e))
+      {
+         CopyMem(batch_hdr, &batch_e, sizeof(batch_e));
+         if ((batch_e.len < sizeof(batch_e) + 2) || (batch_e.len > BATCH_ENTRY_MAX))
+         {
+            log(LOG_ERROR, "*** ERROR: corrupt batch entry at %d\n", batch_pos - len);
+            batch_failed++;
+            batch_pos = (ULONG) -1;
+            return;
+         }
+      }
+      else if ((batch_hdr_len > sizeof(batch_e)) && (batch_hdr_len == batch_e.len))
+      {
+         batch_start();
+         batch_left = batch_e.type == AX_FILE_TYPE_DIR ? 0 : batch_e.size;
+         if (!batch_left)
+            batch_done();
+      }
+   }
+}
+
+/* the client went away mid-batch: delete the entry it left half written */
+static void batch_drop(void)
+{
+   if (!batch)
+      return;
+
+   log(LOG_ERROR, "*** ERROR: batch %s abandoned\n", batch_path);
+   if (io_file)
+   {
+      wb_len = 0;
+      Close((BPTR) io_file);
+      io_file = NULL;
+      DeleteFile(batch_path);
+   }
+   batch           = FALSE;
+   batch_hdr_len   = 0;
+   batch_left      = 0;
+   io_write_failed = FALSE;
+   dir_cache_flush();
+}
+
+/* copy len bytes into / out of the tree ring at stream offset pos */
+static void tree_ring(ULONG pos, UBYTE *buf, LONG len, BOOL put)
+{
+   while (len > 0)
+   {
+      LONG off = pos % tree_size;
+      LONG l   = tree_size - off;
+
+      if (l > len)
+         l = len;
+      if (put)
+         CopyMem(buf, tree_buf + off, l);
+      else
+         CopyMem(tree_buf + off, buf, l);
+      pos += l;
+      buf += l;
+      len -= l;
+   }
+}
+
+/* descend into directory tree_path, FALSE if it cannot be scanned */
+static BOOL tree_push(int base)
+{
+   struct tree_level *lv;
+
+   lv = (struct tree_level *) AllocMem(sizeof(struct tree_level), MEMF_CLEAR);
+   if (!lv)
+      return FALSE;
+
+   lv->lock = Lock(tree_path, ACCESS_READ);
+   if (!lv->lock || !Examine(lv->lock, (BPTR) &lv->fib))
+   {
+      log(LOG_ERROR, "ERR  cannot scan %s, error %d\n", tree_path, IoErr());
+      if (lv->lock)
+         UnLock(lv->lock);
+      FreeMem(lv, sizeof(struct tree_level));
+      return FALSE;
+   }
+   lv->base = base;
+   lv->up   = tree_lv;
+   tree_lv  = lv;
+   return TRUE;
+}
+
+static void tree_pop(void)
+{
+   struct tree_level *lv = tree_lv;
+
+   tree_path[lv->base] = 0;
+   tree_lv = lv->up;
+   UnLock(lv->lock);
+   FreeMem(lv, sizeof(struct tree_level));
+}
+
+/* the entry for fib (at tree_path), FALSE if its name is too long */
+static BOOL tree_entry(struct FileInfoBlock *f, BOOL dir)
+{
+   UBYTE              hdr[BATCH_ENTRY_MAX];
+   struct batch_entry e;
+   char              *name = tree_path + tree_root;
+   int                n;
+
+   if (*name == '/')
+      name++;
+   n = strlen(name) + 1;
+   if (sizeof(e) + n + 1 > BATCH_ENTRY_MAX)
+   {
+      log(LOG_ERROR, "ERR  path too deep, left out: %s\n", tree_path);
+      return FALSE;
+   }
+
+   e.size  = dir ? 0 : f->fib_Size;
+   e.attrs = f->fib_Protection;
+   e.date  = f->fib_Date.ds_Days;
+   e.time  = f->fib_Date.ds_Minute;
+   e.type  = dir ? AX_FILE_TYPE_DIR : AX_FILE_TYPE_FILE;
+   e.pad   = 0;
+
+   /* deep paths lose their comment before they lose the entry */
+   if (sizeof(e) + n + strlen(f->fib_Comment) + 1 <= BATCH_ENTRY_MAX)
+   {
+      CopyMem(f->fib_Comment, hdr + sizeof(e) + n, strlen(f->fib_Comment) + 1);
+      e.len = sizeof(e) + n + strlen(f->fib_Comment) + 1;
+   }
+   else
+   {
+      hdr[sizeof(e) + n] = 0;
+      e.len = sizeof(e) + n + 1;
+   }
+   CopyMem(name, hdr + sizeof(e), n);
+   CopyMem(&e, hdr, sizeof(e));
+
+   tree_ring(tree_hi, hdr, e.len, TRUE);
+   tree_hi += e.len;
+   return TRUE;
+}
+
+/*
+ * generate the tree stream until it reaches upto, the ring is full or the
+ * walk is done
+ */
+static void tree_fill(ULONG upto)
+{
+   while (tree_hi < upto)
+   {
+      LONG room = tree_size - (tree_hi - tree_lo);
+
+      if (tree_fh)
+      {
+         LONG off = tree_hi % tree_size;
+         LONG l   = tree_size - off;
+
+         if (l > room)
+            l = room;
+         if (l > tree_left)
+            l = tree_left;
+         if (l <= 0)
+            return;
+
+         l = Read((BPTR)tree_fh, (char*) tree_buf + off, l);
+         if (l <= 0)
+         {
+            /* keep the stream in step with the size we announced */
+            log(LOG_ERROR, "ERR  read error or short file in %s\n", tree_path);
+            l = tree_left < room ? tree_left : room;
+            l = l < tree_size - off ? l : tree_size - off;
+            memset(tree_buf + off, 0, l);
+         }
+         tree_hi   += l;
+         tree_left -= l;
+         if (!tree_left)
+         {
+            Close((BPTR)tree_fh);
+            tree_fh = NULL;
+         }
+         continue;
+      }
+
+      if (!tree_lv)
+         return;   /* done */
+      if (room < BATCH_ENTRY_MAX)
+         return;
+
+      if (!ExNext(tree_lv->lock, (BPTR) &tree_lv->fib))
+      {
+         if (IoErr() != ERROR_NO_MORE_ENTRIES)
+            log(LOG_ERROR, "ERR  cannot scan %s, error %d\n", tree_path, IoErr());
+         tree_pop();
+         continue;
+      }
+
+      {
+         struct FileInfoBlock *f = &tree_lv->fib;
+         int                   n = path_add(tree_path, f->fib_FileName);
+
+         if (n < 0)
+         {
+            log(LOG_ERROR, "ERR  path too long: %s/%s\n", tree_path, f->fib_FileName);
+            continue;
+         }
+
+         if (f->fib_DirEntryType == ST_USERDIR)
+         {
+            if (!tree_entry(f, TRUE) || !tree_push(n))
+               tree_path[n] = 0;
+            continue;
+         }
+
+         /* links to directories could lead back up into the tree */
+         if (f->fib_DirEntryType == ST_LINKDIR)
+         {
+            log(LOG_INFO, "    link left out: %s\n", tree_path);
+            tree_path[n] = 0;
+            continue;
+         }
+
+         /* links to files are sent as the file, soft ones if they are */
+         tree_fh = (struct FileHandle *) Open(tree_path, MODE_OLDFILE);
+         if (tree_fh && ((f->fib_DirEntryType == ST_SOFTLINK) || 
+                         (f->fib_DirEntryType == ST_LINKFILE)))
+         {
+            /* the link's own entry does not carry the file's size */
+            Seek((BPTR)tree_fh, 0, OFFSET_END);
+            f->fib_Size = Seek((BPTR)tree_fh, 0, OFFSET_BEGINNING);
+         }
+
+         if (!tree_fh)
+         {
+            if (f->fib_DirEntryType == ST_SOFTLINK)
+               log(LOG_INFO, "    link left out: %s\n", tree_path);
+            else
+               log(LOG_ERROR, "ERR  cannot open %s, error %d\n", tree_path, IoErr());
+         }
+         else if (!tree_entry(f, FALSE) || !f->fib_Size)
+         {
+            Close((BPTR)tree_fh);
+            tree_fh = NULL;
+         }
+         else
+         {
+            tree_left = f->fib_Size;
+            tree_files++;
+         }
+         tree_path[n] = 0;
+      }
+   }
+}
+
+static LONG tree_read(ULONG pos, UBYTE *buf, LONG max_len)
+{
+   LONG l;
+
+   if (tx_keep > tree_lo)
+      tree_lo = tx_keep < tree_hi ? tx_keep : tree_hi;
+   if (pos < tree_lo)
+   {
+      log(LOG_ERROR, "*** ERROR: tree stream offset %d is gone\n", pos);
+      return -1;
+   }
+
+   tree_fill(pos + max_len);
+
+   l = tree_hi - pos;
+   if (l > max_len)
+      l = max_len;
+   if (l > 0)
+      tree_ring(pos, buf, l, FALSE);
+   ra_next = pos + (l > 0 ? l : 0);
+   return l;
+}
+
+static void tree_close(void)
+{
+   if (tree_fh)
+      Close((BPTR)tree_fh);
+   tree_fh = NULL;
+   while (tree_lv)
+      tree_pop();
+   if (tree_buf)
+   {
+      log(LOG_INFO, "tree %s: %ld files, %ld bytes\n", tree_path, tree_files, tree_hi);
+      FreeMem(tree_buf, tree_size);
+   }
+   tree_buf = NULL;
+}
+
+/* top up iobuf if it would not hold the next block */
+static void read_ahead(void)
+{
+   if (tree_buf)
+      tree_fill(ra_next + session_blocksize);
+   if (sending && iobuf && !ra_eof && (ra_next + session_blocksize > iobuf_pos + ra_len))
+      ra_fill(ra_next);
+}
+
+/* the ack has to come within the round trip, else write_message() resends */
+static ULONG read_ack(void)
+{
+   ULONG ack = 0xDEADBEEF;
+
+   rx_idle = FALSE;
+   read_serial(4, (UBYTE*) &ack, NULL);
+   return ack;
+}
+
+/*
+ * header, payload and CRC go out with a single CMD_WRITE. MSG_BLOCK
+ * payloads live in msgbuf, which has room for the rest around them.
+ * Anything else is short (no more than a command) and copied to txbuf.
+ */
+static void write_frame(struct ax_header *header, UBYTE *payload, ULONG crc1)
+{
+   UBYTE *frame;
+   int    len = header->len;
+
+   if (!len)
+   {
+      write_serial(12, (UBYTE*) header);
+      return;
+   }
+
+   if (payload == msgbuf)
+      frame = msgbuf - FRAME_HEAD;
+   else if (len <= TX_MAX)
+   {
+      frame = txbuf;
+      CopyMem(payload, frame + FRAME_HEAD, len);
+   }
+   else
+   {
+      log(LOG_ERROR, "*** ERROR: %d byte payload not in msgbuf!\n", len);
+      return;
+   }
+
+   CopyMem(header, frame, FRAME_HEAD);
+   CopyMem(&crc1, frame + FRAME_HEAD + len, 4);
+
+   /* the disk gets the time it takes to send the frame */
+   write_serial_post(FRAME_HEAD + len + 4, frame);
+   read_ahead();
+   write_serial_wait(FRAME_HEAD + len + 4, frame);
+}
+
+static void init_header(struct ax_header *header, WORD msg, ULONG seq, int len)
+{
+   header->sync = 0;
+   header->msg  = msg;
+   header->len  = len;
+   header->seq  = seq;
+   header->crc  = crc32((UBYTE*)header, 8);
+}
+
+static void write_message(WORD msg, UBYTE *payload, int len)
+{
+   struct ax_header header;
+   ULONG crc1     = 0;
+   BOOL  resent   = FALSE;   /* no round trip samples from resent frames */
+   int   timeouts = 0;
+
+   init_header(&header, msg, tx_seq++, len);
+
+   /* computed once, retransmissions reuse it */
+   if (len)
+      crc1 = crc32(payload, len);
+
+   log (LOG_DEBUG, "WMSG: cmd=0x%02x len=%d seq=%d crc=%08x\n",
+        header.msg, header.len, header.seq, header.crc);
+
+   while (TRUE)
+   {
+      ULONG ack, t;
+
+      write_frame(&header, payload, crc1);
+
+      t   = clock_usecs();
+      ack = read_ack();
+      if ((ack == ACK_OK) && !resent)
+         rto_sample(clock_usecs() - t);
+      if (ack == ACK_OK)
+      {
+         link_good(len);
+         break;
+      }
+
+      link_error(len);
+      log (LOG_ERROR, "ERR : read_ack failed! (got: 0x%08x)\n", ack);
+      if (ack == ACK_RESEND)
+      {
+         drain_serial();
+         resent = TRUE;
+         tx_resent++;
+         continue;
+      }
+
+      /* no intact ack within the round trip: the frame or its ack is lost */
+      rto_backoff();
+      if (++timeouts < ACK_TIMEOUTS)
+      {
+         log (LOG_ERROR, "ERR : ack timeout, resending seq %d\n", header.seq);
+         drain_serial();
+         resent = TRUE;
+         tx_resent++;
+         continue;
+      }
+      break;
+   }
+}
+
+static void msg_recv (UBYTE *recv_buf, WORD recv_len)
+{
+   struct Lock     *file_lock;
+   struct InfoData *file_info;
+
+   dir_cache_flush();
+
+   resume_pos = 0;
+   batch_drop();
+   delta_drop();
+   recv = *( (struct ax_recv *)recv_buf );
+   strncpy (filename, (char *)recv_buf+29, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_recv %s size=%d attrs=0x%08x date=%d time=%d ctime=%d len=%d\n",
+       filename, recv.file_size,
+       recv.attrs, recv.date, recv.time, recv.ctime, recv.len);
+
+   /* does this file exist ? */
+
+   file_lock = (struct Lock *) Lock (filename, ACCESS_READ);
+   if (file_lock)
+   {
+      write_message (MSG_IOERR, NULL, 0);
+      UnLock ((BPTR)file_lock);
+   } 
+   else
+   {    
+      /* are we creating a directory here ? */
+
+      if (recv.file_type == AX_FILE_TYPE_DIR)
+      {
+         if (lock)
+         {
+            UnLock((BPTR) lock);
             lock = NULL;
          }
-         lock = (struct Lock *) CreateDir(filename);
-         if (lock)
+         lock = (struct Lock *) CreateDir(filename);
+         if (lock)
+         {
+            log(LOG_DEBUG, "    makedir(%s) succeeded.\n", filename);
+            write_message (MSG_NEXT_PART, NULL, 0);
+         }
+         else
+         {
+            log(LOG_ERROR, "ERR makedir(%s) failed.\n", filename);
+            write_message (MSG_IOERR, NULL, 0);
+         }
+      }
+      else
+      {
+         write_message (MSG_NEXT_PART, NULL, 0);
+      }
+   }
+}
+
+static void msg_mparth (UBYTE *buf, WORD len)
+{
+   /* FIXME: implement? lxamiga.pl puts a constant 0x000002000 here */
+   ULONG unk = *( ((ULONG*) buf) + 1 ); 
+
+   receiving = *( (ULONG*) buf );
+   received  = resume_pos;
+   sending   = 0;
+
+   log(LOG_DEBUG, "msg_mparth receiving=%d, from=%d, flags=%0x08x\n",
+       receiving, resume_pos, io_flags);
+
+   batch_drop();
+   if (io_file)
+   {
+      flush_iobuf();
+      Close((BPTR)io_file);
+   }
+
+   io_write_failed = FALSE;
+
+   if (resume_pos)
+   {
+      io_file = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+      if (io_file && (Seek((BPTR)io_file, resume_pos, OFFSET_BEGINNING) < 0))
+      {
+         Close((BPTR)io_file);
+         io_file = NULL;
+      }
+   }
+   else
+      io_file = (struct FileHandle *) Open(delta_old ? delta_tmp : filename,
+                                           MODE_NEWFILE);
+   if (!io_file)
+   {
+      log(LOG_ERROR, "*** ERROR: couldnt open file for writing: %s\n",
+          filename);
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   io_file_pos = resume_pos;
+   wb_len      = 0;
+   alloc_iobuf();
+
+   if (delta_old)
+   {
+      if (!iobuf)
+      {
+         log(LOG_ERROR, "*** ERROR: no memory for the delta of %s\n", filename);
+         Close((BPTR)io_file);
+         io_file = NULL;
+         DeleteFile(delta_tmp);
+         delta_drop();
+         write_message(MSG_IOERR, NULL, 0);
+         return;
+      }
+      delta_size    = receiving;
+      delta_pos     = 0;
+      wb_out        = 0;
+      delta_old_pos = 0;
+      delta_lit     = 0;
+      delta_op_len  = 0;
+   }
+
+   write_message(MSG_NEXT_PART, NULL, 0);
+
+   if (session_flags & FTS4_F_WINDOW)
+   {
+      rx_stream = TRUE;
+      rx_nacked = FALSE;
+   }
+}
+
+static void block_recv (UBYTE *buf, WORD len)
+{
+   ULONG pos   = *( (ULONG*) buf );
+   BOOL  last;
+
+   if (receiving)
+   {
+      received += len-4;
+      last      = received >= receiving;
+
+      log(LOG_DEBUG, "msg_block recv pos=%d, %d/%d\n", pos, received, receiving);
+
+      /*
+       * answer first, the next block comes in while we write this one. A
+       * write error therefore fails a later block's answer, or MSG_FILE_CLOSE.
+       * The last block is written out before it is answered, without a
+       * header read posted: the answer's ack has to be read first.
+       */
+      if (rx_stream || !last)
+      {
+         if (!rx_stream)
+            write_message(io_write_failed ? MSG_IOERR : MSG_NEXT_PART, NULL, 0);
+         prefetch_header();
+      }
+
+      if (batch)
+         batch_apply(pos, &buf[4], len-4);
+      else if (delta_old)
+         delta_apply(pos, &buf[4], len-4);
+      /* collect contiguous blocks, write them in big chunks */
+      else if (iobuf && (len-4 <= iobuf_size))
+      {
+         /* block sizes vary (adaptive, short blocks), check before copying */
+         if (wb_len && ((pos != iobuf_pos + wb_len) || (wb_len + len-4 > iobuf_size)))
+            flush_iobuf();
+         if (!wb_len)
+            iobuf_pos = pos;
+
+         CopyMem(&buf[4], iobuf + wb_len, len-4);
+         wb_len += len-4;
+
+         if (wb_len == iobuf_size)
+            flush_iobuf();
+      }
+      else
+      {
+         flush_iobuf();
+         write_file(pos, &buf[4], len-4);
+      }
+
+      if (!rx_stream && last)
+      {
+         flush_iobuf();
+         write_message(io_write_failed ? MSG_IOERR : MSG_NEXT_PART, NULL, 0);
+      }
+   }
+   else
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_BLOCK received while not sending!\n");
+      closedown();
+   }
+}
+
+static void msg_block (UBYTE *buf, WORD len)
+{
+   if (session_flags & FTS4_F_COMPRESS)
+   {
+      lz_data   += len-4;
+      lz_wire   += len-4;
+      lz_blocks += 1;
+      lz_raw    += 1;
+   }
+   block_recv(buf, len);
+}
+
+/* unpack into lzbuf (pos in front, like a MSG_BLOCK), then go on as usual */
+static void msg_block_lz (UBYTE *buf, WORD len)
+{
+   UWORD n;
+   LONG  l;
+
+   if (!lzbuf)
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_BLOCK_LZ without FTS4_F_COMPRESS!\n");
+      closedown();
+   }
+
+   CopyMem(&buf[4], &n, 2);
+   l = lz_unpack(&buf[6], len-6, lzbuf+4, lzbuf_size-4);
+   if (l != n)
+   {
+      log(LOG_ERROR, "*** ERROR: corrupt MSG_BLOCK_LZ at pos %d\n", *( (ULONG*) buf ));
+      io_write_failed = TRUE;
+      l = 0;
+   }
+
+   lz_data   += l;
+   lz_wire   += len-4;
+   lz_blocks += 1;
+
+   CopyMem(buf, lzbuf, 4);
+   block_recv(lzbuf, l+4);
+}
+
+/* add an entry to the listing in dirbuf */
+static void put_dirent(struct ax_dirent *dirent, char *name, char *comment)
+{
+   char  *p = dirbuf + dir_fill;
+   ULONG  n = strlen(name)+1;
+   ULONG  m = strlen(comment)+1;
+
+   dirent->len = DIRENT_SIZE + n + m;
+
+   /* entries are not word aligned, so build them in one piece */
+   CopyMem((char*)dirent, p, DIRENT_SIZE);
+   CopyMem(name, p + DIRENT_SIZE, n);
+   CopyMem(comment, p + DIRENT_SIZE + n, m);
+
+   dc_build_put(dir_base + dir_fill, p, dirent->len);
+   dir_fill += dirent->len;
+}
+
+static void dir_close(void)
+{
+   if (dir_lock)
+      UnLock((BPTR) dir_lock);
+   dir_lock = NULL;
+}
+
+/*
+ * start (over) listing directory filename: dirbuf gets the entry count,
+ * dir_next() adds the entries one at a time as they are asked for
+ */
+static BOOL dir_open(void)
+{
+   dir_close();
+
+   dir_lock = (struct FileLock *) Lock(filename, ACCESS_READ);
+   if (!dir_lock)
+   {
+      log (LOG_ERROR, "ERR  lock() failed on %s\n", filename);
+      return FALSE;
+   }
+   if (!Examine((BPTR)dir_lock, (BPTR)fib))
+   {
+      log (LOG_ERROR, "ERR  examine() failed on %s\n", filename);
+      dir_close();
+      return FALSE;
+   }
+
+   log (LOG_DEBUG, "DIR %s size=%d, blocks=%d, dirtype=%d, type=%d\n", 
+        fib->fib_FileName,
+        fib->fib_Size,
+        fib->fib_NumBlocks,
+        fib->fib_DirEntryType,
+        fib->fib_EntryType);
+
+   if (fib->fib_DirEntryType <= 0)
+   {
+      log (LOG_ERROR, "ERR  not a directory: %s\n", filename);
+      dir_close();
+      return FALSE;
+   }
+
+   CopyMem((char*)&dir_count, dirbuf, 4);
+   dir_base       = 0;
+   dir_fill       = 4;
+   dc_build_count = 0;
+   return TRUE;
+}
+
+static ULONG dir_entry_size(void)
+{
+   return DIRENT_SIZE + strlen(fib->fib_FileName)+1 + strlen(fib->fib_Comment)+1;
+}
+
+/* add the next directory entry to dirbuf, FALSE at the end */
+static BOOL dir_next(void)
+{
+   struct ax_dirent dirent;
+
+   if (!dir_lock)
+      return FALSE;
+
+   if (!ExNext((BPTR)dir_lock, (BPTR)fib))
+   {
+      dc_build_done();
+      dir_close();
+      return FALSE;
+   }
+
+   /* stick to what MSG_MPARTH announced */
+   if (dir_base + dir_fill + dir_entry_size() > dir_total)
+   {
+      log (LOG_ERROR, "ERR  %s changed while listing it\n", filename);
+      dc_build_drop();
+      dir_close();
+      return FALSE;
+   }
+
+   log (LOG_DEBUG, "    %s size=%d, blocks=%d, dirtype=%d, type=%d\n", 
+        fib->fib_FileName,
+        fib->fib_Size,
+        fib->fib_NumBlocks,
+        fib->fib_DirEntryType,
+        fib->fib_EntryType);
+
+   dirent.size  = fib->fib_Size ;
+   dirent.used  = fib->fib_Size ;
+   dirent.type  = 0 ;
+   dirent.attrs = fib->fib_Protection ;
+   dirent.date  = fib->fib_Date.ds_Days ;
+   dirent.time  = fib->fib_Date.ds_Minute ;
+   dirent.ctime = fib->fib_Date.ds_Minute ;
+   dirent.type2 = fib->fib_DirEntryType > 0 ? 0x02 : 0x00 ;
+
+   put_dirent(&dirent, fib->fib_FileName, fib->fib_Comment);
+   dc_build_count++;
+   return TRUE;
+}
+
+static void msg_eof (UBYTE *buf, WORD len)
+{
+   log(LOG_DEBUG, "msg_eof\n");
+   flush_iobuf();
+   rx_stream      = FALSE;
+   receiving      = 0;
+   sending        = 0;
+   dirbuf_sending = FALSE;
+   dir_close();
+}
+
+/*
+ * open filename for sending, MSG_MPARTH announces the whole file, the
+ * first MSG_BLOCK starts at pos
+ */
+static void file_send(ULONG pos)
+{
+   log(LOG_DEBUG, "file_send %s from %d\n", filename, pos);
+
+   if (io_file)
+   {
+      flush_iobuf();
+      Close((BPTR)io_file);
+   }
+
+   io_file = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+   if (!io_file)
+   {
+      log(LOG_ERROR, "*** ERROR: couldnt open file for reading: %s\n",
+          filename);
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   receiving = 0;
+   received  = 0;
+
+   /* determine file size */
+   Seek((BPTR)io_file, 0, OFFSET_END);
+   sending = Seek((BPTR)io_file, 0, OFFSET_BEGINNING);
+   if (pos > sending)
+      pos = sending;
+   sent    = pos;
+
+   io_file_pos = 0;
+   iobuf_pos   = 0;
+   ra_len      = 0;
+   ra_next     = pos;
+   ra_eof      = FALSE;
+   alloc_iobuf();
+
+   log (LOG_DEBUG, "file_send: file size is %d bytes.\n", sending);
+   write_message(MSG_MPARTH, (UBYTE*) &sending, 4);
+}
+
+static void msg_file_send (UBYTE *buf, WORD len)
+{
+   strncpy (filename, (char *)buf, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_send %s\n", filename);
+
+   file_send(0);
+}
+
+static void msg_file_send_at (UBYTE *buf, WORD len)
+{
+   ULONG pos = *( (ULONG*) buf );
+
+   if (!(session_flags & FTS4_F_RESUME))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_SEND_AT without FTS4_F_RESUME!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   strncpy (filename, (char *)buf+4, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_send_at %s pos=%d\n", filename, pos);
+
+   file_send(pos);
+}
+
+/* CRC32 of the first len bytes of fh (from its current position) */
+static ULONG file_crc(struct FileHandle *fh, ULONG *len)
+{
+   ULONG  reg32 = crc32_init();
+   ULONG  done  = 0;
+   UBYTE *b;
+   LONG   size;
+   BOOL   own;
+
+   b   = alloc_big(&size);
+   own = b != NULL;
+   if (!own)
+   {
+      b    = msgbuf;
+      size = msgbuf_size;
+   }
+
+   while (done < *len)
+   {
+      LONG l = size;
+      LONG i;
+
+      if (l > *len - done)
+         l = *len - done;
+      l = Read((BPTR)fh, (char*) b, l);
+      if (l <= 0)
+         break;
+
+      /* crc32_update() takes an int */
+      for (i=0; i<l; i+=16384)
+         reg32 = crc32_update(reg32, b+i, l-i > 16384 ? 16384 : (int)(l-i));
+      done += l;
+   }
+
+   if (own)
+      FreeMem(b, size);
+
+   *len = done;
+   return crc32_final(reg32);
+}
+
+static void msg_file_query (UBYTE *buf, WORD len)
+{
+   struct fts4_query  q;
+   struct FileHandle *fh;
+
+   if (!(session_flags & FTS4_F_RESUME))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_QUERY without FTS4_F_RESUME!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   q.len = *( (ULONG*) buf );
+   strncpy (filename, (char *)buf+4, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   fh = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+   if (!fh)
+   {
+      log(LOG_ERROR, "ERR  cannot open %s, error %d\n", filename, IoErr());
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   Seek((BPTR)fh, 0, OFFSET_END);
+   q.size = Seek((BPTR)fh, 0, OFFSET_BEGINNING);
+   if (q.len > q.size)
+      q.len = q.size;
+   q.crc = file_crc(fh, &q.len);
+   Close((BPTR)fh);
+
+   log(LOG_DEBUG, "msg_file_query %s size=%d len=%d crc=%08x\n",
+       filename, q.size, q.len, q.crc);
+
+   write_message(MSG_FILE_QUERY, (UBYTE*) &q, sizeof(q));
+}
+
+static void sig_free(void)
+{
+   if (sig_buf)
+      FreeMem(sig_buf, sig_len);
+   sig_buf = NULL;
+}
+
+/*
+ * block checksums of fh for MSG_FILE_SIGS, see FTS4_F_DELTA. bs shrinks
+ * if we cannot get a buffer that big.
+ */
+static BOOL sig_build(struct FileHandle *fh, ULONG size, ULONG bs)
+{
+   ULONG *sig;
+   ULONG  done = 0;
+   UBYTE *b;
+   LONG   b_size, chunk;
+   BOOL   own;
+
+   b   = alloc_big(&b_size);
+   own = b != NULL;
+   if (!own)
+   {
+      b      = msgbuf;
+      b_size = msgbuf_size;
+   }
+   while (bs > b_size)
+      bs /= 2;
+   chunk = b_size / bs * bs;   /* whole blocks per Read() */
+
+   sig_len = 8 + (size + bs - 1) / bs * 8;
+   sig_buf = AllocMem(sig_len, 0);
+
+   if (sig_buf)
+   {
+      sig    = (ULONG *) sig_buf;
+      *sig++ = size;
+      *sig++ = bs;
+
+      /* never past size, sig_buf has no room for a file that grew */
+      while (done < size)
+      {
+         LONG r = size - done < chunk ? size - done : chunk;
+         LONG l = Read((BPTR)fh, (char*) b, r);
+         LONG i;
+
+         if (l <= 0)
+            break;
+
+         for (i=0; i<l; i+=bs)
+         {
+            UBYTE *p = b + i;
+            LONG   n = l-i < bs ? l-i : bs;
+            ULONG  sa = 0, sb = 0;
+            LONG   j;
+
+            for (j=0; j<n; j++)
+            {
+               sa += p[j];
+               sb += sa;
+            }
+            *sig++ = ((sb & 0xffff) << 16) | (sa & 0xffff);
+            *sig++ = crc32(p, (int) n);
+         }
+         done += l;
+         if (l < r)             /* short read: the file shrank */
+            break;
+      }
+   }
+
+   if (own)
+      FreeMem(b, b_size);
+
+   if (done != size)
+   {
+      sig_free();
+      return FALSE;
+   }
+   return sig_buf != NULL;
+}
+
+/* MSG_FILE_RECV for an existing file, continued at pos */
+static void msg_file_resume (UBYTE *buf, WORD len)
+{
+   ULONG              pos = *( (ULONG*) buf );
+   struct FileHandle *fh;
+   ULONG              size;
+   BOOL               ok;
+
+   if (!(session_flags & FTS4_F_RESUME))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_RESUME without FTS4_F_RESUME!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   recv = *( (struct ax_recv *)(buf+4) );
+   if (!pos || (recv.file_type == AX_FILE_TYPE_DIR))
+   {
+      msg_recv(buf+4, len-4);
+      return;
+   }
+
+   dir_cache_flush();
+
+   resume_pos = 0;
+   batch_drop();
+   delta_drop();
+   strncpy (filename, (char *)buf+4+29, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_resume %s pos=%d size=%d\n",
+       filename, pos, recv.file_size);
+
+   fh = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+   if (!fh)
+   {
+      log(LOG_ERROR, "ERR  cannot open %s, error %d\n", filename, IoErr());
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   /* anything behind pos has not been verified, cut it off */
+   Seek((BPTR)fh, 0, OFFSET_END);
+   size = Seek((BPTR)fh, 0, OFFSET_BEGINNING);
+   ok   = size == pos;
+   if ((size > pos) && (DOSBase->dl_lib.lib_Version >= 36))
+      ok = SetFileSize((BPTR)fh, pos, OFFSET_BEGINNING) == pos;
+   Close((BPTR)fh);
+
+   if (!ok)
+   {
+      log(LOG_ERROR, "ERR  cannot resume %s (%d bytes) at %d\n",
+          filename, size, pos);
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   resume_pos = pos;
+   write_message(MSG_NEXT_PART, NULL, 0);
+}
+
+/*
+ * fetch up to max_len bytes of the outgoing file or directory listing
+ * at stream offset pos
+ */
+static LONG read_block(ULONG pos, UBYTE *buf, LONG max_len)
+{
+   LONG l;
+
+   if (sending && iobuf)
+   {
+      if ((pos < iobuf_pos) || (pos > iobuf_pos + ra_len) || 
+          (!ra_eof && (pos + max_len > iobuf_pos + ra_len)))
+         ra_fill(pos);
+
+      l = iobuf_pos + ra_len - pos;
+      if (l > max_len)
+         l = max_len;
+      if (l > 0)
+         CopyMem(iobuf + (pos - iobuf_pos), (char*)buf, l);
+      ra_next = pos + (l > 0 ? l : 0);
+      return l;
+   }
+
+   if (sending)
+   {
+      /* only seek when going back for a retransmission */
+      if (pos != io_file_pos)
+         Seek((BPTR)io_file, pos, OFFSET_BEGINNING);
+      l = Read((BPTR)io_file, (char*) buf, max_len);
+      io_file_pos = l > 0 ? pos + l : (ULONG) -1;
+      return l;
+   }
+
+   if (tree_buf)
+      return tree_read(pos, buf, max_len);
+
+   if (sig_buf)
+   {
+      if (pos >= sig_len)
+         return 0;
+      l = sig_len - pos;
+      if (l > max_len)
+         l = max_len;
+      CopyMem(sig_buf + pos, (char*)buf, l);
+      return l;
+   }
+
+   if (dir_cached)
+   {
+      if (pos >= dir_cached->size)
+         return 0;
+      l = dir_cached->size - pos;
+      if (l > max_len)
+         l = max_len;
+      CopyMem(dir_cached->data + pos, (char*)buf, l);
+      return l;
+   }
+
+   /* went back further than dirbuf reaches: list it again */
+   if ((pos < dir_base) && !dir_open())
+      return 0;
+
+   while (dir_lock && (pos + max_len > dir_base + dir_fill))
+   {
+      if (dir_fill + DIRENT_MAX > DIRBUF_SIZE)
+      {
+         /* make room, nothing before pos is asked for anymore */
+         ULONG drop = pos - dir_base;
+         ULONG i;
+
+         if (drop > dir_fill)
+            drop = dir_fill;
+         for (i=drop; i<dir_fill; i++)
+            dirbuf[i-drop] = dirbuf[i];
+         dir_base += drop;
+         dir_fill -= drop;
+
+         if (dir_fill + DIRENT_MAX > DIRBUF_SIZE)
+            break;
+      }
+      if (!dir_next())
+         break;
+   }
+
+   if (pos >= dir_base + dir_fill)
+      return 0;
+
+   l = dir_base + dir_fill - pos;
+   if (l > max_len)
+      l = max_len;
+   CopyMem(dirbuf + (pos - dir_base), (char*)buf, l);
+   return l;
+}
+
+/*
+ * acks carry no CRC: a garbled one is dropped, and if bytes went missing
+ * we get back in step at the next word that looks like an ack. Later acks
+ * cover the dropped one.
+ */
+static BOOL read_stream_ack(ULONG *ack, ULONG *seq)
+{
+   UBYTE a[8];
+   int   have = 0;
+
+   while ((have += read_serial(8 - have, a + have, NULL)) == 8)
+   {
+      int i, j;
+
+      for (i=0; i<=4; i++)
+      {
+         CopyMem(a + i, ack, 4);
+         if ((*ack == ACK_OK) || (*ack == ACK_RESEND))
+            break;
+      }
+      if (!i)
+      {
+         CopyMem(a + 4, seq, 4);
+         return TRUE;
+      }
+
+      log(LOG_ERROR, "ERR : garbled stream ack, %d bytes dropped\n", i > 4 ? 8 : i);
+      link_error(0);
+      if (i > 4)
+         i = 8;
+      for (j=i; j<8; j++)
+         a[j-i] = a[j];
+      have        = 8 - i;
+      rx_dropped += i;
+   }
+   *ack = 0;
+   return FALSE;
+}
+
+/*
+ * the l bytes read to buf+4 go out as MSG_BLOCK_LZ if they shrink, sets
+ * *len to the payload size and returns the message type. msgbuf has room
+ * for the parity block_parity() adds behind it.
+ */
+static WORD block_pack(UBYTE *buf, LONG l, LONG *len)
+{
+   LONG n = 0;
+
+   if (session_flags & FTS4_F_COMPRESS)
+   {
+      n = lz_pack(&buf[4], l, lzbuf, l - 3);
+      lz_data   += l;
+      lz_blocks += 1;
+   }
+
+   if (n > 0)
+   {
+      UWORD w = l;
+
+      CopyMem(&w, &buf[4], 2);
+      CopyMem(lzbuf, &buf[6], n);
+      *len     = n + 6;
+      lz_wire += n + 2;
+      return MSG_BLOCK_LZ;
+   }
+
+   if (session_flags & FTS4_F_COMPRESS)
+   {
+      lz_wire += l;
+      lz_raw  += 1;
+   }
+   *len = l + 4;
+   return MSG_BLOCK;
+}
+
+/* FTS4_F_FEC: parity behind the len bytes of a packed block, new length */
+static LONG block_parity(UBYTE *buf, LONG len)
+{
+   if (!session_parity)
+      return len;
+   fec_encode(buf, len, buf + len, session_parity);
+   return len + fec_size(len, session_parity);
+}
+
+/*
+ * windowed transfer (FTS4_F_WINDOW): keep up to session_window MSG_BLOCK
+ * frames in flight, finish with a MSG_EOF frame. Nothing is buffered for
+ * retransmission, on a NACK or timeout we simply go back to the offset
+ * the missing frame started at and read the data again.
+ */
+static void stream_send(UBYTE *buf, ULONG pos, BOOL dir)
+{
+   ULONG win_pos[MAX_WINDOW];   /* stream offset of each frame in flight */
+   ULONG win_time[MAX_WINDOW];  /* ...and when it went out               */
+   ULONG redo     = tx_seq;     /* frames before this went out before... */
+   ULONG redo_end = pos;        /* ...and that is where the last ended   */
+   ULONG base     = tx_seq;     /* oldest unacknowledged frame           */
+   ULONG next     = tx_seq;     /* next frame to send                    */
+   ULONG eof_seq  = 0;
+   BOOL  eof_sent = FALSE;
+   BOOL  done     = FALSE;
+   int   timeouts = 0;
+
+   log(LOG_DEBUG, "stream_send window=%d pos=%d seq=%d\n", session_window, pos, next);
+
+   while (!done)
+   {
+      /* fill the window */
+      while (!eof_sent && ((next - base) < session_window))
+      {
+         struct ax_header header;
+         LONG             l;
+         LONG             max = tx_blocksize(dir);
+
+         /*
+          * a resent frame has to carry what it did the first time, the
+          * peer may have that seq already (only our ack timed out)
+          */
+         if ((LONG) (next - redo) < 0)
+            max = ((LONG) (next + 1 - redo) < 0 ?
+                   win_pos[(next + 1) % MAX_WINDOW] : redo_end) - pos;
+
+         win_pos[next % MAX_WINDOW] = pos;
+         tx_keep = win_pos[base % MAX_WINDOW];
+         l = read_block(pos, buf+4, max);
+
+         if (l > 0)
+         {
+            LONG n;
+            WORD msg;
+
+            *((ULONG*)buf) = pos;
+            msg = block_pack(buf, l, &n);
+            n   = block_parity(buf, n);
+            init_header(&header, msg, next, n);
+            log(LOG_DEBUG, "stream_send block seq=%d pos=%d len=%d/%d err=%d/MB\n",
+                next, pos, l, n, link_error_rate());
+            write_frame(&header, buf, crc32(buf, (int) n));
+            win_time[next % MAX_WINDOW] = clock_usecs();
+            link_good(n);
+            pos += l;
+         }
+         else
          {
-            log(LOG_DEBUG, "    makedir(%s) succeeded.\n", filename);
-            write_message (MSG_NEXT_PART, NULL, 0);
+            /* data we cannot produce any more ends the stream as well */
+            init_header(&header, l < 0 ? MSG_IOERR : MSG_EOF, next, 0);
+            log(LOG_DEBUG, "stream_send %s seq=%d\n", l < 0 ? "ioerr" : "eof", next);
+            write_frame(&header, NULL, 0);
+            win_time[next % MAX_WINDOW] = clock_usecs();
+            eof_seq  = next;
+            eof_sent = TRUE;
+         }
+         next++;
+
+         if (serial_avail() >= 8)
+            break;
+      }
+
+      /* collect acks, block only if there is nothing left to send */
+      while (!done && 
+             (eof_sent || ((next - base) >= session_window) || (serial_avail() >= 8)))
+      {
+         ULONG ack = 0, seq, go_back;
+
+         if (!read_stream_ack(&ack, &seq))
+         {
+            rto_backoff();
+            if (++timeouts < STREAM_ACK_TIMEOUTS)
+               continue;
+            log(LOG_ERROR, "ERR : stream ack timeout, resending from seq %d\n", base);
+            link_error(0);
+            go_back = base;
+         }
+         else if ((ack == ACK_OK) && ((seq - base) < (next - base)))
+         {
+            if ((LONG) (seq - redo) >= 0)
+               rto_sample(clock_usecs() - win_time[seq % MAX_WINDOW]);
+            timeouts = 0;
+            base     = seq + 1;
+            done     = eof_sent && (base == eof_seq + 1);
+            continue;
+         }
+         else if ((ack == ACK_RESEND) && ((seq - base) <= (next - base)))
+         {
+            log(LOG_ERROR, "ERR : stream NACK, resending from seq %d\n", seq);
+            link_error(0);
+            go_back = seq;
+         }
+         else
+         {
+            continue; /* stale */
+         }
+
+         /*
+          * after a NACK the peer has nothing from go_back on, after a
+          * timeout it may have any of it
+          */
+         timeouts   = 0;
+         tx_resent += next - go_back;
+         if (ack == ACK_RESEND)
+            redo = go_back;
+         else if ((LONG) (next - redo) > 0)
+         {
+            redo     = next;
+            redo_end = pos;
+         }
+         base     = go_back;
+         if (go_back != next)
+            pos = win_pos[go_back % MAX_WINDOW];
+         next     = go_back;
+         if (eof_sent && (eof_seq >= go_back))
+            eof_sent = FALSE;
+         done     = eof_sent && (base == eof_seq + 1);
+         break;
+      }
+   }
+
+   tx_seq = next;
+}
+
+static void msg_next_part (UBYTE *buf, WORD len)
+{
+   ULONG pos   = *( (ULONG*) buf );
+
+   if (session_flags & FTS4_F_WINDOW)
+   {
+      if (sending)
+      {
+         stream_send(buf, sent, FALSE);
+         return;
+      }
+      if (dirbuf_sending)
+      {
+         stream_send(buf, dirbuf_done, TRUE);
+         dirbuf_done=0;
+         dirbuf_sending=FALSE;
+         dir_close();
+         sig_free();
+         tree_close();
+         return;
+      }
+   }
+
+   if (sending)
+   {
+      LONG  l;
+      LONG  bs = tx_blocksize(FALSE);
+      l = read_block(sent, &buf[4], bs);
+
+      log(LOG_DEBUG, "msg_next_part send %d/%d bs=%d err=%d/MB\n",
+          sent, sending, bs, link_error_rate());
+
+      if (l>0)
+      {
+         LONG n;
+         WORD msg;
+
+         *((ULONG*)buf) = sent;
+         msg = block_pack(buf, l, &n);
+         n   = block_parity(buf, n);
+	 write_message(msg, buf, (int) n);
+         sent += l;
+      }
+      else
+      {
+	 write_message(MSG_EOF, NULL, 0);
+      }
+   }
+   else
+   {
+      if (dirbuf_sending)
+      {
+         LONG  bs = tx_blocksize(TRUE);
+         LONG  l;
+
+         tx_keep = dirbuf_done;
+         l       = read_block(dirbuf_done, &buf[4], bs);
+
+         log(LOG_DEBUG, "msg_next_part send dir %d\n", dirbuf_done);
+
+         if (l>0)
+         {
+            LONG n;
+            WORD msg;
+
+            *((ULONG*)buf) = dirbuf_done;
+            msg = block_pack(buf, l, &n);
+            n   = block_parity(buf, n);
+	    write_message(msg, buf, (int) n);
+            dirbuf_done += l;
+         }
+         else
+         {
+	    write_message(l < 0 ? MSG_IOERR : MSG_EOF, NULL, 0);
+            dirbuf_done=0;
+            dirbuf_sending=FALSE;
+            dir_close();
+            sig_free();
+            tree_close();
+         }
+      }
+      else
+      {
+         log(LOG_DEBUG, "SYNC\n");
+      }
+   }
+}
+
+static ULONG now_secs(void)
+{
+   struct DateStamp ds;
+
+   DateStamp(&ds);
+   return ds.ds_Days * 86400L + ds.ds_Minute * 60L + ds.ds_Tick / TICKS_PER_SECOND;
+}
+
+/*
+ * walk the DOS list: its fingerprint, or a copy of its volumes if table
+ * is not NULL. We have to use internal dos.library structures in order
+ * to stay kickstart 1.3 compatible. Nothing in here may do I/O.
+ */
+static ULONG vol_scan(struct vol_cache *table, int *count)
+{
+   struct RootNode   *rootnode;
+   struct DosInfo    *dosinfo;
+   struct DeviceList *devicelist;
+   ULONG              sig = 0;
+   int                n   = 0;
+
+   Forbid();
+      
+   rootnode   = (struct RootNode*)   DOSBase->dl_Root;
+   dosinfo    = (struct DosInfo *)   BADDR(rootnode->rn_Info);
+   devicelist = (struct DeviceList*) BADDR(dosinfo->di_DevInfo);
+
+   while (devicelist->dl_Next)
+   {
+      /* no disk in the drive: locking it would bring up a requester */
+      if ((devicelist->dl_Type == DLT_VOLUME) && devicelist->dl_Task)
+      {
+         sig = sig * 31 + (ULONG) devicelist + (ULONG) devicelist->dl_Task +
+               devicelist->dl_VolumeDate.ds_Days + 
+               devicelist->dl_VolumeDate.ds_Minute + 
+               devicelist->dl_VolumeDate.ds_Tick;
+
+         if (table && (n < MAX_VOLUMES))
+         {
+            struct vol_cache *v   = &table[n];
+            UBYTE            *str = (UBYTE*) BADDR(devicelist->dl_Name);
+            int               l   = str[0] < sizeof(v->name)-2 ? str[0] : sizeof(v->name)-2;
+
+            v->node    = devicelist;
+            v->date    = devicelist->dl_VolumeDate;
+            CopyMem(str+1, v->name, l);
+            v->name[l]   = ':';
+            v->name[l+1] = 0;
+            v->info_ok   = FALSE;
+            v->info_time = 0;
+         }
+         n++;
+      }
+      devicelist = (struct DeviceList *) BADDR(devicelist->dl_Next);
+   }
+      
+   Permit();
+
+   if (count)
+      *count = n < MAX_VOLUMES ? n : MAX_VOLUMES;
+   return sig ^ n;
+}
+
+/* bring vol_cache up to date, at the least cost we can get away with */
+static void vol_refresh(void)
+{
+   ULONG now = now_secs();
+   ULONG sig = vol_scan(NULL, NULL);
+   int   i;
+
+   if (!vol_valid || (sig != vol_sig) || (now - vol_time >= VOL_TTL))
+   {
+      static struct vol_cache old[MAX_VOLUMES];
+      int                     old_count = vol_count;
+
+      CopyMem(vol_cache, old, sizeof(old));
+      vol_sig   = vol_scan(vol_cache, &vol_count);
+      vol_time  = now;
+      vol_valid = TRUE;
+
+      /* Info() of volumes that are still there stays good */
+      for (i=0; i<vol_count; i++)
+      {
+         int j;
+         for (j=0; j<old_count; j++)
+         {
+            if ( (old[j].node == vol_cache[i].node) &&
+                 !strcmp(old[j].name, vol_cache[i].name) )
+            {
+               vol_cache[i].size      = old[j].size;
+               vol_cache[i].used      = old[j].used;
+               vol_cache[i].attrs     = old[j].attrs;
+               vol_cache[i].info_ok   = old[j].info_ok;
+               vol_cache[i].info_time = old[j].info_time;
+               break;
+            }
+         }
+      }
+      log(LOG_DEBUG, "vol_refresh: %d volumes\n", vol_count);
+   }
+
+   for (i=0; i<vol_count; i++)
+   {
+      struct vol_cache *v = &vol_cache[i];
+      BPTR              dev_lock;
+
+      if (v->info_time && (now - v->info_time < INFO_TTL))
+         continue;
+
+      log (LOG_DEBUG, "    Info %s\n", v->name);
+
+      v->info_ok   = FALSE;
+      v->info_time = now;
+
+      dev_lock = Lock(v->name, ACCESS_READ);
+      if (!dev_lock)
+         continue;
+      if (Info(dev_lock, info_data))
+      {
+         v->size    = info_data->id_NumBlocks * info_data->id_BytesPerBlock;
+         v->used    = info_data->id_NumBlocksUsed * info_data->id_BytesPerBlock;
+         v->attrs   = info_data->id_DiskState == ID_WRITE_PROTECTED ? 0x04 : 0x00;
+         v->info_ok = TRUE;
+      }
+      UnLock(dev_lock);
+   }
+}
+
+static void msg_dir (UBYTE *buf, WORD len)
+{
+   strncpy (filename, (char *)buf, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_dir %s\n", filename);
+
+   dir_close();
+   dc_build_drop();
+   dir_cached = NULL;
+   sig_free();
+   tree_close();
+   sending = 0;
+
+   if (strlen(filename)>0)
+   {
+      dir_count = DIR_UNKNOWN;
+      dir_total = DIR_UNKNOWN;
+
+      if (!dir_open())
+      {
+         write_message(MSG_EOF, NULL, 0);
+         return;
+      }
+
+      dir_cached = dir_cache_find();
+      if (dir_cached)
+      {
+         log(LOG_DEBUG, "dir cache: %s hit\n", filename);
+         dir_close();
+         dir_total = dir_cached->size;
+      }
+      /* classic clients need the size up front, count the entries first */
+      else if (!(session_flags & FTS4_F_DIRSTREAM))
+      {
+         ULONG total = 4;
+
+         dir_count = 0;
+         while (ExNext((BPTR)dir_lock, (BPTR)fib))
+         {
+            total     += dir_entry_size();
+            dir_count += 1;
          }
-         else
+         dir_total = total;
+
+         if (!dir_open())
          {
-            log(LOG_ERROR, "ERR makedir(%s) failed.\n", filename);
-            write_message (MSG_IOERR, NULL, 0);
+            write_message(MSG_EOF, NULL, 0);
+            return;
          }
       }
-      else
+      if (!dir_cached)
+         dc_build_start();
+
+      dirbuf_sending = TRUE;
+      dirbuf_done = 0;
+      write_message(MSG_MPARTH, (UBYTE*)&dir_total, 4); 
+   }
+   else /* filename=="" -> list devices */
+   {
+      int i;
+
+      vol_refresh();
+
+      dir_count = 0;
+      dir_base  = 0;
+      dir_fill  = 4;
+
+      for (i=0; i<vol_count; i++)
       {
-         write_message (MSG_NEXT_PART, NULL, 0);
+         struct vol_cache *v = &vol_cache[i];
+         struct ax_dirent  dirent;
+
+         if (!v->info_ok)
+            continue;
+
+         if ( (dir_fill + DIRENT_MAX) > DIRBUF_SIZE )
+         {
+            log (LOG_ERROR, "ERR  *** dirbuf overflow!\n");
+            break;
+         }
+
+         dirent.size  = v->size ;
+         dirent.used  = v->used ;
+         dirent.type  = 0x0000 ;
+         dirent.attrs = v->attrs ;
+         dirent.date  = v->date.ds_Days ;
+         dirent.time  = v->date.ds_Minute ;
+         dirent.ctime = v->date.ds_Minute ; 
+         dirent.type2 = 0 ;
+
+         put_dirent(&dirent, v->name, "");
+         dir_count += 1;
       }
+
+      CopyMem((char*)&dir_count, dirbuf, 4);
+      dir_total = dir_fill;
+
+      dirbuf_sending = TRUE;
+      dirbuf_done = 0;
+      write_message(MSG_MPARTH, (UBYTE*)&dir_total, 4); 
    }
 }
 
-static void msg_mparth (UBYTE *buf, WORD len)
+/*
+ * native copy: streams between two file handles through a big buffer
+ * and keeps protection bits, comment and date. Directories are copied
+ * with everything in them. Paths are built up in cp_src and cp_dst, one
+ * FileInfoBlock per directory level is all the memory a deep tree costs.
+ * Links to directories are not followed; a copy that had to leave any
+ * out fails with ERROR_OBJECT_WRONG_TYPE, though the rest is there.
+ * Returns 0 or the DOS error code.
+ */
+static char   cp_src[PATH_MAX];
+static char   cp_dst[PATH_MAX];
+static UBYTE *cp_buf;
+static LONG   cp_buf_size;
+static ULONG  cp_skipped;   /* links left out */
+
+static void copy_attrs(char *dst, struct FileInfoBlock *src_fib)
 {
-   /* FIXME: implement? lxamiga.pl puts a constant 0x000002000 here */
-   ULONG unk = *( ((ULONG*) buf) + 1 ); 
+   if (src_fib->fib_Comment[0])
+      SetComment(dst, src_fib->fib_Comment);
+   if (DOSBase->dl_lib.lib_Version >= 36)
+      SetFileDate(dst, &src_fib->fib_Date);
+   SetProtection(dst, src_fib->fib_Protection);
+}
 
-   receiving = *( (ULONG*) buf );
-   received  = 0;
-   sending   = 0;
+static LONG copy_file(struct FileInfoBlock *src_fib)
+{
+   BPTR in, out;
+   LONG l, err = 0;
 
-   log(LOG_DEBUG, "msg_mparth receiving=%d, flags=%0x08x\n", receiving, io_flags);
+   in = Open(cp_src, MODE_OLDFILE);
+   if (!in)
+      return IoErr();
 
-   if (io_file)
-      Close((BPTR)io_file);
+   out = Open(cp_dst, MODE_NEWFILE);
+   if (!out)
+   {
+      err = IoErr();
+      Close(in);
+      return err;
+   }
 
-   io_file = (struct FileHandle *) Open(filename, MODE_NEWFILE);
-   if (!io_file)
+   while ((l = Read(in, (char*) cp_buf, cp_buf_size)) > 0)
    {
-      log(LOG_ERROR, "*** ERROR: couldnt open file for writing: %s\n",
-          filename);
-      write_message(MSG_IOERR, NULL, 0);
-      return;
+      if (Write(out, (char*) cp_buf, l) != l)
+      {
+         err = IoErr();
+         break;
+      }
    }
+   if (l < 0)
+      err = IoErr();
 
-   write_message(MSG_NEXT_PART, NULL, 0);
+   Close(out);
+   Close(in);
+
+   if (err)
+   {
+      DeleteFile(cp_dst);
+      return err;
+   }
+
+   copy_attrs(cp_dst, src_fib);
+   return 0;
 }
 
-static void msg_block (UBYTE *buf, WORD len)
+static LONG copy_object(struct FileInfoBlock *src_fib)
 {
-   ULONG pos   = *( (ULONG*) buf );
-
-   if (receiving)
+   struct FileInfoBlock *sub;
+   BPTR                  l;
+   LONG                  err = 0;
+
+   /* a hard link to a file is copied as the file, links to directories
+      are not followed, they can lead back up into the tree */
+   if ((src_fib->fib_DirEntryType == ST_SOFTLINK) ||
+       (src_fib->fib_DirEntryType == ST_LINKDIR))
    {
-      received += len-4;
+      log(LOG_ERROR, "ERR  link not copied: %s\n", cp_src);
+      cp_skipped++;
+      return 0;
+   }
 
-      log(LOG_DEBUG, "msg_block recv pos=%d, %d/%d\n", pos, received, receiving);
+   log(LOG_DEBUG, "    copy %s -> %s\n", cp_src, cp_dst);
 
-      Seek((BPTR)io_file, pos, OFFSET_BEGINNING);
-      Write((BPTR)io_file, (char*) &buf[4], len-4);
+   if ((src_fib->fib_DirEntryType != ST_USERDIR) &&
+       (src_fib->fib_DirEntryType != ST_ROOT))
+      return copy_file(src_fib);
 
-      write_message(MSG_NEXT_PART, NULL, 0);
-   }
-   else
+   l = (BPTR) CreateDir(cp_dst);
+   if (!l)
+      return IoErr();
+   UnLock(l);
+
+   sub = (struct FileInfoBlock *) AllocMem(sizeof(struct FileInfoBlock), 0);
+   if (!sub)
+      return ERROR_NO_FREE_STORE;
+
+   l = Lock(cp_src, ACCESS_READ);
+   if (!l || !Examine(l, (BPTR) sub))
+      err = IoErr();
+
+   while (!err && ExNext(l, (BPTR) sub))
    {
-      log(LOG_ERROR, "*** ERROR: MSG_BLOCK received while not sending!\n");
-      closedown();
+      int ls = path_add(cp_src, sub->fib_FileName);
+      int ld = path_add(cp_dst, sub->fib_FileName);
+
+      if ((ls < 0) || (ld < 0))
+         err = ERROR_LINE_TOO_LONG;
+      else
+         err = copy_object(sub);
+
+      if (ls >= 0)
+         cp_src[ls] = 0;
+      if (ld >= 0)
+         cp_dst[ld] = 0;
    }
+   if (!err && (IoErr() != ERROR_NO_MORE_ENTRIES))
+      err = IoErr();
+
+   if (l)
+      UnLock(l);
+   FreeMem(sub, sizeof(struct FileInfoBlock));
+
+   if (!err)
+      copy_attrs(cp_dst, src_fib);
+   return err;
 }
 
-static void msg_eof (UBYTE *buf, WORD len)
+/* the directory path lives in */
+static BPTR lock_parent(char *path)
 {
-   log(LOG_DEBUG, "msg_eof\n");
-   receiving      = 0;
-   sending        = 0;
-   dirbuf_sending = FALSE;
+   char *base = path_base(path);
+   char  c;
+   BPTR  l;
+
+   if ((base > path + 1) && (base[-1] == '/') && 
+       (base[-2] != '/') && (base[-2] != ':'))
+      base--;
+   c     = *base;
+   *base = 0;
+   l     = Lock(path, ACCESS_READ);
+   *base = c;
+   return l;
 }
 
-static void msg_file_send (UBYTE *buf, WORD len)
+static BOOL same_lock(BPTR a, BPTR b)
 {
-   strncpy (filename, (char *)buf, PATH_MAX);
-   filename[PATH_MAX-1] = 0;
+   struct FileLock *fa = (struct FileLock *) BADDR(a);
+   struct FileLock *fb = (struct FileLock *) BADDR(b);
 
-   log(LOG_DEBUG, "msg_file_send %s\n", filename);
+   if (DOSBase->dl_lib.lib_Version >= 36)
+      return SameLock(a, b) == LOCK_SAME;
 
-   if (io_file)
-      Close((BPTR)io_file);
+   return (fa->fl_Volume == fb->fl_Volume) && (fa->fl_Key == fb->fl_Key);
+}
 
-   io_file = (struct FileHandle *) Open(filename, MODE_OLDFILE);
-   if (!io_file)
+/* TRUE if path would be created in directory dir or somewhere below it */
+static BOOL inside(char *path, BPTR dir)
+{
+   BPTR l = lock_parent(path), p;
+   BOOL in = FALSE;
+
+   while (l && !in)
    {
-      log(LOG_ERROR, "*** ERROR: couldnt open file for reading: %s\n",
-          filename);
-      write_message(MSG_IOERR, NULL, 0);
-      return;
+      in = same_lock(l, dir);
+      p  = (BPTR) ParentDir((struct FileLock *) l);
+      UnLock(l);
+      l  = p;
    }
+   if (l)
+      UnLock(l);
+   return in;
+}
 
-   receiving = 0;
-   received  = 0;
-
-   /* determine file size */
-   Seek((BPTR)io_file, 0, OFFSET_END);
-   sending = Seek((BPTR)io_file, 0, OFFSET_BEGINNING);
-   sent    = 0;
+/* like C:Copy and C:Rename, an existing directory as dst means "into it" */
+static LONG into_dir(char *dst, char *src, struct FileInfoBlock *fib_tmp)
+{
+   BPTR l   = Lock(dst, ACCESS_READ);
+   LONG err = 0;
 
-   log (LOG_DEBUG, "msg_file_send: file size is %d bytes.\n", sending);
-   write_message(MSG_MPARTH, (UBYTE*) &sending, 4);
+   if (l)
+   {
+      if (Examine(l, (BPTR) fib_tmp) && (fib_tmp->fib_DirEntryType > 0) &&
+          (path_add(dst, path_base(src)) < 0))
+         err = ERROR_LINE_TOO_LONG;
+      UnLock(l);
+   }
+   return err;
 }
 
-static void msg_next_part (UBYTE *buf, WORD len)
+static LONG copy_path(char *src, char *dst)
 {
-   ULONG pos   = *( (ULONG*) buf );
+   struct FileInfoBlock *src_fib;
+   BPTR                  l;
+   LONG                  err;
 
-   if (sending)
-   {
-      ULONG l;
-      sent = Seek((BPTR)io_file, 0, OFFSET_CURRENT);
-      l = Read((BPTR)io_file, (char*) &buf[4], READSIZE);
+   src_fib = (struct FileInfoBlock *) AllocMem(sizeof(struct FileInfoBlock), 0);
+   if (!src_fib)
+      return ERROR_NO_FREE_STORE;
 
-      log(LOG_DEBUG, "msg_next_part send %d/%d\n", sent, sending);
+   strcpy(cp_src, src);
+   strcpy(cp_dst, dst);
 
-      if (l>0)
-      {
-         *((ULONG*)buf) = sent;
-	 write_message(MSG_BLOCK, buf, l+4);
-      }
-      else
-      {
-	 write_message(MSG_EOF, NULL, 0);
-      }
+   err = into_dir(cp_dst, cp_src, src_fib);
+
+   l = err ? 0 : Lock(cp_src, ACCESS_READ);
+   if (!err && (!l || !Examine(l, (BPTR) src_fib)))
+      err = IoErr();
+
+   /* a directory copied into itself would never end */
+   if (!err && (src_fib->fib_DirEntryType != ST_FILE) && inside(cp_dst, l))
+   {
+      log(LOG_ERROR, "ERR  %s is inside %s\n", cp_dst, cp_src);
+      err = ERROR_OBJECT_IN_USE;
    }
-   else
+   if (l)
+      UnLock(l);
+
+   if (!err)
    {
-      if (dirbuf_sending)
+      cp_buf = alloc_big(&cp_buf_size);
+      if (!cp_buf)
       {
-         ULONG l = dirbuf_todo > BUFSIZE-4 ? BUFSIZE-4 : dirbuf_todo;
+         /* the request has been parsed, msgbuf is free until we answer */
+         cp_buf      = msgbuf;
+         cp_buf_size = msgbuf_size;
+      }
 
-         log(LOG_DEBUG, "msg_next_part send dir %d\n", dirbuf_done);
+      cp_skipped = 0;
+      err = copy_object(src_fib);
 
-         if (l>0)
-         {
-            *((ULONG*)buf) = dirbuf_done;
-            CopyMem(dirbuf+dirbuf_done, (char*)buf+4, l);
-	    write_message(MSG_BLOCK, buf, l+4);
-            dirbuf_todo -= l;
-            dirbuf_done += l;
-         }
-         else
-         {
-	    write_message(MSG_EOF, NULL, 0);
-            dirbuf_todo=0;
-            dirbuf_done=0;
-            dirbuf_sending=FALSE;
-         }
-      }
-      else
+      /* the rest is copied, but the copy is not complete */
+      if (!err && cp_skipped)
       {
-         log(LOG_DEBUG, "SYNC\n");
+         log(LOG_ERROR, "ERR  %ld links left out of %s\n", cp_skipped, cp_dst);
+         err = ERROR_OBJECT_WRONG_TYPE;
       }
+
+      if (cp_buf != msgbuf)
+         FreeMem(cp_buf, cp_buf_size);
    }
+
+   FreeMem(src_fib, sizeof(struct FileInfoBlock));
+   return err;
 }
 
-static void BSTR2C(BSTR *bstr, char *buf)
+/*
+ * native recursive delete. Entries are deleted one step behind ExNext(),
+ * so the scan of a directory is never disturbed by removing the entry it
+ * stands on. Protected objects are unprotected first (like FORCE). Every
+ * failure is logged; a directory is kept if something in it could not go.
+ */
+struct del_level
+{
+   struct FileInfoBlock fib;        /* first, AllocMem() keeps it aligned */
+   char                 prev[108];
+   BOOL                 prev_dir;
+};
+
+static char  del_path[PATH_MAX];
+static ULONG del_count, del_failed;
+static LONG  del_error;   /* of the last failure */
+
+static void delete_one(void)
 {
-   LONG   counter = 0;
-   UBYTE *str = (UBYTE*) BADDR(bstr);
-   LONG   i;
-   
-   for (i = (LONG) str[0]; i--; counter++)
+   LONG err;
+
+   if (DeleteFile(del_path))
+   {
+      del_count++;
+      return;
+   }
+
+   err = IoErr();
+   if ((err == ERROR_DELETE_PROTECTED) || (err == ERROR_WRITE_PROTECTED))
    {
-      buf[counter] = str[counter+1];
+      if (SetProtection(del_path, 0) && DeleteFile(del_path))
+      {
+         del_count++;
+         return;
+      }
+      err = IoErr();
    }
-   buf[counter]=0;
+
+   log(LOG_ERROR, "ERR  cannot delete %s, error %d\n", del_path, err);
+   del_error = err;
+   del_failed++;
 }
 
-static void msg_dir (UBYTE *buf, WORD len)
+/* everything in directory del_path, then the directory itself */
+static void delete_tree(void)
 {
-   strncpy (filename, (char *)buf, PATH_MAX);
-   filename[PATH_MAX-1] = 0;
+   struct del_level *lv;
+   BPTR              l;
+   ULONG             failed = del_failed;
 
-   log(LOG_DEBUG, "msg_dir %s\n", filename);
-
-   if (lock)
+   lv = (struct del_level *) AllocMem(sizeof(struct del_level), MEMF_CLEAR);
+   if (!lv)
    {
-      UnLock((BPTR) lock);
-      lock = NULL;
+      log(LOG_ERROR, "ERR  out of memory deleting %s\n", del_path);
+      del_error = ERROR_NO_FREE_STORE;
+      del_failed++;
+      return;
    }
 
-   if (strlen(filename)>0)
+   l = Lock(del_path, ACCESS_READ);
+   if (l && Examine(l, (BPTR) &lv->fib))
    {
-      lock = (struct Lock *) Lock(filename, ACCESS_READ);
-      if (lock)
+      while (TRUE)
       {
-         if (Examine((BPTR)lock, (BPTR)fib))
-         {
+         BOOL more = ExNext(l, (BPTR) &lv->fib);
+         LONG err  = IoErr();
 
-            log (LOG_DEBUG, "DIR %s size=%d, blocks=%d, dirtype=%d, type=%d\n", 
-                 fib->fib_FileName,
-                 fib->fib_Size,
-                 fib->fib_NumBlocks,
-                 fib->fib_DirEntryType,
-                 fib->fib_EntryType);
+         if (lv->prev[0])
+         {
+            int n = path_add(del_path, lv->prev);
 
-            if (fib->fib_DirEntryType>0)
+            if (n < 0)
             {
-               char  *dirbuf_ptr  = dirbuf + 4;
-               ULONG  dirbuf_size = 0;
-               ULONG  dir_cnt     = 0;
-
-               dirbuf_todo = 4;
-
-               while (ExNext((BPTR)lock, (BPTR)fib))
-               {
-                  ULONG entry_size, n, m;
-                  struct ax_dirent *dirent;
-
-                  n = strlen(fib->fib_FileName)+1;
-                  m = strlen(fib->fib_Comment)+1;
-                  entry_size = 29 + m + n;
-
-                  log (LOG_DEBUG, "    %s size=%d, blocks=%d, dirtype=%d, type=%d, n=%d, m=%d, entry_size=%d\n", 
-                       fib->fib_FileName,
-                       fib->fib_Size,
-                       fib->fib_NumBlocks,
-                       fib->fib_DirEntryType,
-                       fib->fib_EntryType,
-                       n, m, entry_size);
-
-                  if ( (dirbuf_todo + entry_size) > DIRBUF_SIZE )
-                  {
-                     log (LOG_ERROR, "ERR  *** dirbuf overflow!\n");
-                     break;
-                  }
-                  dirent = (struct ax_dirent *) dirbuf_ptr;
-                  dirent->len   = entry_size ;
-                  dirent->size  = fib->fib_Size ;
-                  dirent->used  = fib->fib_Size ;
-                  dirent->type  = 0 ;
-                  dirent->attrs = fib->fib_Protection ;
-                  dirent->date  = fib->fib_Date.ds_Days ;
-                  dirent->time  = fib->fib_Date.ds_Minute ;
-                  dirent->ctime = fib->fib_Date.ds_Minute ;
-                  dirent->type2 = fib->fib_DirEntryType > 0 ? 0x02 : 0x00 ;
-
-                  dirbuf_ptr += 29;
-                  CopyMem(fib->fib_FileName, dirbuf_ptr, n);
-                  dirbuf_ptr += n;
-                  CopyMem(fib->fib_Comment, dirbuf_ptr, m);
-                  dirbuf_ptr += m;
-
-                  dirbuf_todo = (LONG)dirbuf_ptr - (LONG)dirbuf;
-
-                  dir_cnt += 1;
-               }
-
-               *((ULONG *) dirbuf) = dir_cnt;
-
-               UnLock((BPTR) lock);
-               lock = NULL;
-               sending = 0;
-               dirbuf_sending = TRUE;
-               dirbuf_done = 0;
-               write_message(MSG_MPARTH, (UBYTE*)&dirbuf_todo, 4); 
+               log(LOG_ERROR, "ERR  path too long: %s/%s\n", del_path, lv->prev);
+               del_error = ERROR_LINE_TOO_LONG;
+               del_failed++;
             }
             else
             {
-               UnLock((BPTR) lock);
-               lock = NULL;
-               log (LOG_ERROR, "ERR  not a directory: %s\n", filename);
-               write_message(MSG_EOF, NULL, 0); 
+               if (lv->prev_dir)
+                  delete_tree();
+               else
+                  delete_one();
+               del_path[n] = 0;
             }
          }
-         else
+
+         if (!more)
          {
-            UnLock((BPTR) lock);
-            lock = NULL;
-            log (LOG_ERROR, "ERR  examine() failed on %s\n", filename);
-            write_message(MSG_EOF, NULL, 0);
+            if (err != ERROR_NO_MORE_ENTRIES)
+            {
+               log(LOG_ERROR, "ERR  cannot scan %s, error %d\n", del_path, err);
+               del_error = err;
+               del_failed++;
+            }
+            break;
          }
-      }
-      else
-      {
-         log (LOG_ERROR, "ERR  lock() failed on %s\n", filename);
-         write_message(MSG_EOF, NULL, 0);
+
+         strcpy(lv->prev, lv->fib.fib_FileName);
+         lv->prev_dir = lv->fib.fib_DirEntryType == ST_USERDIR;
       }
    }
-   else /* filename=="" -> list devices */
+   else
    {
-      /* we have to extract these from internal dos.library
-          structures in order to stay kickstart 1.3 compatible  */
-  
-      struct RootNode   *rootnode;
-      struct DosInfo    *dosinfo;
-      struct DeviceList *devicelist;
-      struct FileLock   *filelock;
-   
-      char              *dirbuf_ptr  = dirbuf + 4;
-      ULONG              dirbuf_size = 0;
-      ULONG              dir_cnt     = 0;
-
-      Forbid();
-      
-      rootnode   = (struct RootNode*)   DOSBase->dl_Root;
-      dosinfo    = (struct DosInfo *)   BADDR(rootnode->rn_Info);
-      devicelist = (struct DeviceList*) BADDR(dosinfo->di_DevInfo);
+      del_error = IoErr();
+      log(LOG_ERROR, "ERR  cannot scan %s, error %d\n", del_path, del_error);
+      del_failed++;
+   }
 
-      dirbuf_todo = 4;
+   if (l)
+      UnLock(l);
+   FreeMem(lv, sizeof(struct del_level));
 
-      while (devicelist->dl_Next)
-      {
-         char              devname[257];
-         ULONG             entry_size, n, m;
-         struct ax_dirent *dirent;
-         BPTR              dev_lock = NULL;
+   if (del_failed == failed)
+      delete_one();
+}
 
-         if (devicelist->dl_Type != DLT_VOLUME) 
-         {
-            devicelist = (struct DeviceList *) BADDR(devicelist->dl_Next);
-            continue;
-         }
+static UBYTE name_upper(UBYTE c)
+{
+   if (((c >= 'a') && (c <= 'z')) || ((c >= 0xe0) && (c <= 0xfe) && (c != 0xf7)))
+      return c - 0x20;
+   return c;
+}
 
-         BSTR2C(devicelist->dl_Name, devname);
-         devname[strlen(devname)+1] = 0; 
-         devname[strlen(devname)]   = 58; /* append : */
-         
-         log (LOG_DEBUG, "    %s\n", devname);
+/* DOS names compare without case */
+static BOOL same_name(char *a, char *b)
+{
+   while (name_upper(*a) == name_upper(*b))
+   {
+      if (!*a)
+         return TRUE;
+      a++;
+      b++;
+   }
+   return FALSE;
+}
 
-         dev_lock = Lock(devname, ACCESS_READ);
-         if (dev_lock)
-         {
-            n = strlen(devname)+1;
-            m = 1;
-            entry_size = 29 + m + n;
+/*
+ * type of path's own directory entry. Lock() would resolve a link, so
+ * the entry is looked up in its parent directory. 0 if it is not there.
+ */
+static LONG entry_type(char *path, struct FileInfoBlock *f)
+{
+   char *name = path_base(path);
+   BPTR  l;
+   LONG  type = 0;
 
-            if ( (dirbuf_todo + entry_size) > DIRBUF_SIZE )
-            {
-               log (LOG_ERROR, "ERR  *** dirbuf overflow!\n");
-               UnLock(dev_lock);
-               break;
-            }
+   if (!*name)
+      l = Lock(path, ACCESS_READ);
+   else
+      l = lock_parent(path);
+   if (!l)
+      return 0;
 
-            if (Info(dev_lock, info_data))
+   if (Examine(l, (BPTR) f))
+   {
+      if (!*name)
+         type = f->fib_DirEntryType;
+      else
+         while (ExNext(l, (BPTR) f))
+         {
+            if (same_name(f->fib_FileName, name))
             {
-               dirent = (struct ax_dirent *) dirbuf_ptr;
-               dirent->len   = entry_size ;
-               
-               dirent->size  = info_data->id_NumBlocks * info_data->id_BytesPerBlock ;
-               dirent->used  = info_data->id_NumBlocksUsed * info_data->id_BytesPerBlock ;
-               dirent->type  = 0x0000 ;
-               dirent->attrs = info_data->id_DiskState == ID_WRITE_PROTECTED ? 0x04 : 0x00 ;
-               dirent->date  = devicelist->dl_VolumeDate.ds_Days ;
-               dirent->time  = devicelist->dl_VolumeDate.ds_Minute ;
-               dirent->ctime = devicelist->dl_VolumeDate.ds_Minute ; 
-               dirent->type2 = 0 ;
-               
-               dirbuf_ptr += 29;
-               CopyMem(devname, dirbuf_ptr, n);
-               dirbuf_ptr += n;
-               *dirbuf_ptr=0;
-               dirbuf_ptr += m;
-
-               dirbuf_todo = (LONG)dirbuf_ptr - (LONG)dirbuf;
-
-               dir_cnt += 1;
+               type = f->fib_DirEntryType;
+               break;
             }
-            UnLock(dev_lock);
          }
-         devicelist = (struct DeviceList *) BADDR(devicelist->dl_Next);
-      }
-      
-      Permit();
+   }
+   UnLock(l);
+   return type;
+}
+
+/* delete path, with everything in it. TRUE if all of it is gone */
+static BOOL delete_path(char *path)
+{
+   LONG type;
+   int  n;
 
-      *((ULONG *) dirbuf) = dir_cnt;
+   del_count  = 0;
+   del_failed = 0;
 
-      sending = 0;
-      dirbuf_sending = TRUE;
-      dirbuf_done = 0;
-      write_message(MSG_MPARTH, (UBYTE*)&dirbuf_todo, 4); 
+   /* the listing's lock would be in the way, and we borrow its fib */
+   dir_close();
+
+   if (strlen(path) >= PATH_MAX)
+   {
+      del_error = ERROR_LINE_TOO_LONG;
+      return FALSE;
    }
+   strcpy(del_path, path);
+
+   /* "dir/" is dir, its entry is looked up below */
+   n = strlen(del_path);
+   if ((n > 1) && (del_path[n-1] == '/') && 
+       (del_path[n-2] != '/') && (del_path[n-2] != ':'))
+      del_path[n-1] = 0;
+
+   /* a link is removed itself, never what it points to */
+   type = entry_type(del_path, fib);
+   if ((type == ST_USERDIR) || (type == ST_ROOT))
+      delete_tree();
+   else
+      delete_one();
+
+   log(LOG_DEBUG, "    deleted %d objects, %d failed\n", del_count, del_failed);
+   return !del_failed;
 }
 
 static void msg_file_delete (UBYTE *buf, WORD len)
 {
-   int    l;
    BOOL   success = FALSE;
 
+   dir_cache_flush();
+
    strncpy (filename, (char *)buf, PATH_MAX);
    filename[PATH_MAX-1] = 0;
 
    log(LOG_DEBUG, "msg_file_delete %s\n", filename);
 
-   l = strlen(filename);
-   if ( (l>0) && (l<(BUFSIZE-30)) )
-   {
-      sprintf(cmdbuf, "delete \"%s\" ALL FORCE QUIET", filename); 
-      log(LOG_DEBUG, "    execute %s\n", cmdbuf);
-      success = Execute(cmdbuf,0,0);
-   }
+   if (strlen(filename)>0)
+      success = delete_path(filename);
 
    if (success)
       write_message(MSG_NEXT_PART, NULL, 0);
@@ -954,6 +4300,8 @@ static void msg_file_rename (UBYTE *buf, WORD len)
    BOOL             success;
    struct FileLock *parent_lock, *old_lock;
 
+   dir_cache_flush();
+
    strncpy (filename, (char *)buf, PATH_MAX);
    filename[PATH_MAX-1] = 0;
    n = strlen(filename);
@@ -1002,10 +4350,85 @@ static void msg_file_rename (UBYTE *buf, WORD len)
       write_message(MSG_IOERR, NULL, 0);
 }
 
+static BOOL same_volume(BPTR a, BPTR b)
+{
+   if (DOSBase->dl_lib.lib_Version >= 36)
+      return SameLock(a, b) != LOCK_DIFFERENT;
+
+   return ((struct FileLock *) BADDR(a))->fl_Volume == 
+          ((struct FileLock *) BADDR(b))->fl_Volume;
+}
+
+/*
+ * a plain Rename() when source and target are on the same volume, which
+ * is atomic. Across volumes the source is copied, and only deleted once
+ * the copy is complete; a failed copy is removed again.
+ */
+static LONG move_path(char *src, char *dst)
+{
+   BPTR  src_lock, dst_lock;
+   BOOL  same;
+   LONG  err;
+
+   dir_close();
+
+   err = into_dir(dst, src, fib);
+   if (err)
+      return err;
+
+   src_lock = Lock(src, ACCESS_READ);
+   if (!src_lock)
+      return IoErr();
+
+   /* the directory the target goes into */
+   dst_lock = lock_parent(dst);
+   if (!dst_lock)
+   {
+      err = IoErr();
+      UnLock(src_lock);
+      return err;
+   }
+
+   same = same_volume(src_lock, dst_lock);
+   UnLock(dst_lock);
+   UnLock(src_lock);
+
+   if (same)
+   {
+      log(LOG_DEBUG, "    rename %s -> %s\n", src, dst);
+      return Rename(src, dst) ? 0 : IoErr();
+   }
+
+   /* copy + delete, never over something that is already there */
+   dst_lock = Lock(dst, ACCESS_READ);
+   if (dst_lock)
+   {
+      UnLock(dst_lock);
+      return ERROR_OBJECT_EXISTS;
+   }
+
+   err = copy_path(src, dst);
+   if (err)
+   {
+      log(LOG_ERROR, "ERR  copy %s -> %s failed, error %d\n", cp_src, cp_dst, err);
+      dst_lock = Lock(dst, ACCESS_READ);
+      if (dst_lock)
+      {
+         UnLock(dst_lock);
+         delete_path(dst);
+      }
+      return err;
+   }
+
+   return delete_path(src) ? 0 : del_error;
+}
+
 static void msg_file_move (UBYTE *buf, WORD len)
 {
    int  n;
-   BOOL success;
+   LONG err;
+
+   dir_cache_flush();
 
    strncpy (filename, (char *)buf, PATH_MAX);
    filename[PATH_MAX-1] = 0;
@@ -1016,46 +4439,23 @@ static void msg_file_move (UBYTE *buf, WORD len)
 
    log(LOG_DEBUG, "msg_file_move %s -> %s\n", filename, newname);
 
-   /* this needs to work across devices.
-      Well try a simple rename first. If that fails,
-      well user copy + remove                        */
-
-   sprintf(cmdbuf, "rename >NIL: \"%s\" TO \"%s\"", filename, newname); 
-   log(LOG_DEBUG, "    execute %s\n", cmdbuf);
-   success = Execute(cmdbuf,0,0) && (IoErr()==0);
-
-   if (success)
-   {
+   err = move_path(filename, newname);
+   if (!err)
       write_message(MSG_NEXT_PART, NULL, 0);
-   }
    else
    {
-      /* ok, copy+remove it is */
-      sprintf(cmdbuf, "copy \"%s\" TO \"%s\"", filename, newname); 
-      log(LOG_DEBUG, "    execute %s\n", cmdbuf);
-      success = Execute(cmdbuf,0,0) && (IoErr()==0);
-      if (!success)
-      {
-         log(LOG_ERROR, "ERR  failed %s\n", cmdbuf);
-         write_message(MSG_IOERR, NULL, 0);
-      }
-      else
-      {
-         sprintf(cmdbuf, "delete \"%s\" QUIET", filename); 
-         log(LOG_DEBUG, "    execute %s\n", cmdbuf);
-         success = Execute(cmdbuf,0,0);
-         if (success)
-            write_message(MSG_NEXT_PART, NULL, 0);
-         else
-            write_message(MSG_IOERR, NULL, 0);
-      }
+      log(LOG_ERROR, "ERR  move %s -> %s failed, error %d\n", 
+          filename, newname, err);
+      write_message(MSG_IOERR, NULL, 0);
    }
 }
 
 static void msg_file_copy (UBYTE *buf, WORD len)
 {
    int  n;
-   BOOL success;
+   LONG err;
+
+   dir_cache_flush();
 
    strncpy (filename, (char *)buf, PATH_MAX);
    filename[PATH_MAX-1] = 0;
@@ -1066,13 +4466,15 @@ static void msg_file_copy (UBYTE *buf, WORD len)
 
    log(LOG_DEBUG, "msg_file_copy %s -> %s\n", filename, newname);
 
-   sprintf(cmdbuf, "copy \"%s\" TO \"%s\"", filename, newname); 
-   log(LOG_DEBUG, "    execute %s\n", cmdbuf);
-   success = Execute(cmdbuf,0,0) && (IoErr()==0);
-   if (success)
+   err = copy_path(filename, newname);
+   if (!err)
       write_message(MSG_NEXT_PART, NULL, 0);
    else
+   {
+      log(LOG_ERROR, "ERR  copy %s -> %s failed, error %d\n", 
+          cp_src, cp_dst, err);
       write_message(MSG_IOERR, NULL, 0);
+   }
 }
 
 static void msg_file_attr (UBYTE *buf, WORD len)
@@ -1081,6 +4483,8 @@ static void msg_file_attr (UBYTE *buf, WORD len)
    BOOL success = TRUE;
    LONG attrs;
 
+   dir_cache_flush();
+
    attrs = *((LONG *) buf);
 
    strncpy (filename, (char *)buf+4, PATH_MAX);
@@ -1102,11 +4506,279 @@ static void msg_file_attr (UBYTE *buf, WORD len)
       write_message(MSG_IOERR, NULL, 0);
 }
 
+static ULONG delta_blocksize(ULONG bs)
+{
+   if (bs < DELTA_MIN_BS)
+      return DELTA_MIN_BS;
+   if (bs > DELTA_MAX_BS)
+      return DELTA_MAX_BS;
+   return bs;
+}
+
+static void msg_file_sigs (UBYTE *buf, WORD len)
+{
+   ULONG              bs = delta_blocksize(*( (ULONG*) buf ));
+   struct FileHandle *fh;
+   ULONG              size;
+
+   if (!(session_flags & FTS4_F_DELTA))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_SIGS without FTS4_F_DELTA!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   strncpy (filename, (char *)buf+4, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_sigs %s bs=%d\n", filename, bs);
+
+   dir_close();
+   dc_build_drop();
+   dir_cached = NULL;
+   sig_free();
+   tree_close();
+   sending = 0;
+
+   fh = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+   if (!fh)
+   {
+      log(LOG_ERROR, "ERR  cannot open %s, error %d\n", filename, IoErr());
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   Seek((BPTR)fh, 0, OFFSET_END);
+   size = Seek((BPTR)fh, 0, OFFSET_BEGINNING);
+
+   if (!sig_build(fh, size, bs))
+   {
+      Close((BPTR)fh);
+      log(LOG_ERROR, "ERR  cannot checksum %s\n", filename);
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   Close((BPTR)fh);
+
+   /* sent like a directory listing */
+   dirbuf_sending = TRUE;
+   dirbuf_done    = 0;
+   write_message(MSG_MPARTH, (UBYTE*)&sig_len, 4);
+}
+
+static void msg_tree_send (UBYTE *buf, WORD len)
+{
+   ULONG total = 0xffffffff;
+   LONG  need;
+
+   if (!(session_flags & FTS4_F_TREE))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_TREE_SEND without FTS4_F_TREE!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   strncpy (tree_path, (char *)buf, PATH_MAX);
+   tree_path[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_tree_send %s\n", tree_path);
+
+   dir_close();
+   dc_build_drop();
+   dir_cached = NULL;
+   sig_free();
+   tree_close();
+   sending = 0;
+
+   tree_root  = strlen(tree_path);
+   tree_lo    = tree_hi = 0;
+   tree_files = 0;
+   tx_keep    = 0;
+   if (!tree_push(tree_root))
+   {
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   if (tree_lv->fib.fib_DirEntryType <= 0)
+   {
+      log(LOG_ERROR, "ERR  not a directory: %s\n", tree_path);
+      tree_pop();
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   /* a full window of the largest blocks must stay around for resends */
+   need  = session_flags & FTS4_F_BLOCKSIZE ? session_blocksize : BUFSIZE-4;
+   need  = (session_window + 1) * need + BATCH_ENTRY_MAX;
+
+   tree_buf = alloc_big(&tree_size);
+   if (tree_buf && (tree_size < need))
+   {
+      FreeMem(tree_buf, tree_size);
+      tree_buf = NULL;
+   }
+   if (!tree_buf)
+   {
+      tree_size = need;
+      tree_buf  = AllocMem(tree_size, 0);
+   }
+   if (!tree_buf)
+   {
+      log(LOG_ERROR, "ERR  out of memory for tree of %s\n", tree_path);
+      tree_pop();
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   /* sent like a streamed directory listing */
+   dirbuf_sending = TRUE;
+   dirbuf_done    = 0;
+   write_message(MSG_MPARTH, (UBYTE*)&total, 4);
+}
+
+static void msg_file_delta (UBYTE *buf, WORD len)
+{
+   if (!(session_flags & FTS4_F_DELTA))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_DELTA without FTS4_F_DELTA!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   dir_cache_flush();
+
+   resume_pos = 0;
+   batch_drop();
+   delta_drop();
+   delta_bs = delta_blocksize(*( (ULONG*) buf ));
+   recv     = *( (struct ax_recv *)(buf+4) );
+   strncpy (filename, (char *)buf+4+29, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_delta %s bs=%d size=%d\n",
+       filename, delta_bs, recv.file_size);
+
+   /* the new version is built in the same directory */
+   if (!delta_name(delta_tmp, filename, DELTA_NEW))
+   {
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   delta_old = (struct FileHandle *) Open(filename, MODE_OLDFILE);
+   if (!delta_old)
+   {
+      log(LOG_ERROR, "ERR  cannot open %s, error %d\n", filename, IoErr());
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   write_message(MSG_NEXT_PART, NULL, 0);
+}
+
+static void msg_file_batch (UBYTE *buf, WORD len)
+{
+   struct Lock *l;
+
+   if (!(session_flags & FTS4_F_BATCH))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_FILE_BATCH without FTS4_F_BATCH!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   dir_cache_flush();
+
+   resume_pos = 0;
+   batch_drop();
+   delta_drop();
+   strncpy (filename, (char *)buf+4, PATH_MAX);
+   filename[PATH_MAX-1] = 0;
+
+   log(LOG_DEBUG, "msg_file_batch %s len=%d\n", filename, *( (ULONG*) buf ));
+
+   /* we borrow the listing's fib */
+   dir_close();
+
+   l = (struct Lock *) Lock(filename, ACCESS_READ);
+   if (!l)
+   {
+      log(LOG_ERROR, "ERR  cannot lock %s, error %d\n", filename, IoErr());
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   if (!Examine((BPTR) l, (BPTR) fib) ||
+       ((fib->fib_DirEntryType != ST_USERDIR) && (fib->fib_DirEntryType != ST_ROOT)))
+   {
+      log(LOG_ERROR, "ERR  %s is not a directory\n", filename);
+      UnLock((BPTR) l);
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+   UnLock((BPTR) l);
+
+   if (io_file)
+   {
+      flush_iobuf();
+      Close((BPTR)io_file);
+      io_file = NULL;
+   }
+
+   strcpy(batch_path, filename);
+   batch           = TRUE;
+   batch_base      = strlen(batch_path);
+   batch_pos       = 0;
+   batch_hdr_len   = 0;
+   batch_left      = 0;
+   batch_files     = 0;
+   batch_failed    = 0;
+   io_write_failed = FALSE;
+   receiving       = *( (ULONG*) buf );
+   received        = 0;
+   sending         = 0;
+   wb_len          = 0;
+   alloc_iobuf();
+
+   write_message(MSG_NEXT_PART, NULL, 0);
+
+   if (session_flags & FTS4_F_WINDOW)
+   {
+      rx_stream = TRUE;
+      rx_nacked = FALSE;
+   }
+}
+
+/* end of a batch: drop an incomplete last entry, report the outcome */
+static void batch_finish(void)
+{
+   if (batch_left || batch_hdr_len)
+   {
+      log(LOG_ERROR, "*** ERROR: batch ends inside an entry\n");
+      io_write_failed = TRUE;
+      batch_ok        = FALSE;
+      batch_done();
+   }
+   batch = FALSE;
+
+   log(LOG_INFO, "batch %s: %ld entries, %ld failed\n",
+       filename, batch_files, batch_failed);
+   io_write_failed = batch_failed != 0;
+}
+
 static void msg_close (UBYTE *buf, WORD len)
 {
+   tree_close();
+   if (batch)
+   {
+      batch_finish();
+      dir_cache_flush();
+   }
    if (io_file)
    {
+      flush_iobuf();
       Close((BPTR) io_file);
+      if (delta_old)
+         delta_finish();
+      if (received)
+         dir_cache_flush();   /* size and date of what we wrote */
       SetProtection(filename, recv.attrs);
       if (DOSBase->dl_lib.lib_Version >= 36)
       {
@@ -1118,17 +4790,302 @@ static void msg_close (UBYTE *buf, WORD len)
       }
       io_file = NULL;
    }
+   delta_drop();
+   resume_pos = 0;
    if (lock)
    {
       UnLock ((BPTR)lock);
       lock = NULL;
    } 
+   free_iobuf();
+   log_serial_ios();
+   rx_stream = FALSE;
+   if (io_write_failed)
+   {
+      io_write_failed = FALSE;
+      write_message(MSG_IOERR, NULL, 0);
+   }
    write_message(MSG_ACK_CLOSE, NULL, 0);
 }
 
+/*
+ * (re-)allocate the message buffer, the old one is kept if we run out of
+ * memory. Outgoing frames are built around the payload in it, so there is
+ * room for a header in front and a CRC behind.
+ */
+static BOOL alloc_msgbuf(LONG size)
+{
+   UBYTE *b;
+
+   if (size < BUFSIZE)
+      size = BUFSIZE;   /* paths and other commands still have to fit */
+   if (size == msgbuf_size)
+      return TRUE;
+
+   b = AllocMem(size + FRAME_HEAD + FRAME_TAIL, 0);
+   if (!b)
+      return FALSE;
+
+   if (msgbuf)
+      FreeMem(msgbuf - FRAME_HEAD, msgbuf_size + FRAME_HEAD + FRAME_TAIL);
+   msgbuf      = b + FRAME_HEAD;
+   msgbuf_size = size;
+   return TRUE;
+}
+
+/* room for a window full of frames in the serial.device read buffer */
+static ULONG rbuf_len(void)
+{
+   ULONG l = session_blocksize + BLOCK_OVERHEAD;
+
+   if (session_parity)
+      l += fec_size(l, session_parity);
+   l *= session_window;
+
+   if (l < BUFSIZE)
+      l = BUFSIZE;
+   if (l > MAX_RBUFLEN)
+      l = MAX_RBUFLEN;
+   return (l + 63) & ~63;
+}
+
+/* the rate the last MSG_BAUD on this device ended at, 0: none */
+static ULONG baud_load(void)
+{
+   char  name[64];
+   char  txt[12];
+   BPTR  fh;
+   LONG  l;
+
+   sprintf(name, BAUD_FILE, device_name);
+   fh = Open(name, MODE_OLDFILE);
+   if (!fh)
+      return 0;
+   l = Read(fh, txt, sizeof(txt)-1);
+   Close(fh);
+   if (l <= 0)
+      return 0;
+   txt[l] = 0;
+   return atol(txt);
+}
+
+static void baud_save(ULONG baud)
+{
+   char  name[64];
+   char  txt[12];
+   BPTR  fh;
+
+   if (baud == baud_load())
+      return;
+
+   sprintf(name, BAUD_FILE, device_name);
+   fh = Open(name, MODE_NEWFILE);
+   if (!fh)
+   {
+      log(LOG_DEBUG, "baud_save: cannot open %s, error %d\n", name, IoErr());
+      return;
+   }
+   sprintf(txt, "%ld\n", baud);
+   Write(fh, txt, strlen(txt));
+   Close(fh);
+}
+
+/*
+ * wait for the client's probe and echo it, TRUE if the echo got acked.
+ * Nothing but an intact probe for the rate we are at is acked, so a bad
+ * line just stays silent until both sides give up.
+ */
+static BOOL baud_probe(void)
+{
+   struct ax_header header;
+   ULONG            crc1, crc2, ack;
+   int              i;
+
+   rx_idle = TRUE;
+   if (read_serial(12, (UBYTE *) &rx_header, NULL) != 12)
+      return FALSE;
+   header = rx_header;
+   if ( (header.crc != crc32((UBYTE *) &header, 8)) ||
+        (header.msg != MSG_BAUD) || (header.len != 4 + BAUD_PROBE_LEN) )
+      return FALSE;
+
+   crc2 = crc32_init();
+   if ( (read_serial(header.len, msgbuf, &crc2) != header.len) ||
+        (read_serial(4, (UBYTE *) &crc1, NULL) != 4) ||
+        (crc1 != crc32_final(crc2)) || (*((ULONG *) msgbuf) != baudrate) )
+      return FALSE;
+   for (i=0; i<BAUD_PROBE_LEN; i++)
+      if (msgbuf[4+i] != (UBYTE) i)
+         return FALSE;
+
+   rx_seq = header.seq + 1;
+   write_ack();
+
+   init_header(&header, MSG_BAUD, tx_seq++, 4 + BAUD_PROBE_LEN);
+   write_frame(&header, msgbuf, crc1);
+   return (read_serial(4, (UBYTE *) &ack, NULL) == 4) && (ack == ACK_OK);
+}
+
+static void msg_baud (UBYTE *buf, WORD len)
+{
+   ULONG baud = *( (ULONG*) buf );
+   ULONG old  = baudrate;
+   BOOL  ok;
+
+   if (!(session_flags & FTS4_F_BAUD) || (len < 4))
+   {
+      log(LOG_ERROR, "*** ERROR: MSG_BAUD without FTS4_F_BAUD!\n");
+      write_message(MSG_IOERR, NULL, 0);
+      return;
+   }
+
+   if (!baud)
+   {
+      baud = baud_load();
+      if (baud > baud_max)
+         baud = baud_max;
+      log(LOG_DEBUG, "msg_baud: last good rate %ld\n", baud);
+      write_message(MSG_BAUD, (UBYTE*) &baud, 4);
+      return;
+   }
+
+   /* refuse what the device cannot do before the client commits to it */
+   if ((baud < BAUD_MIN) || (baud > baud_max) || ((baud != old) && !baud_ok(baud)))
+      baud = 0;
+   write_message(MSG_BAUD, (UBYTE*) &baud, 4);
+   if (!baud || (baud == old))
+      return;
+
+   /* the client switches once it has acked, so the line is quiet now */
+   ok = set_baud(baud);
+
+   if (baud_probe())
+      log(LOG_INFO, "%ld baud probe ok\n", baud);
+   else
+   {
+      log(LOG_INFO, "%ld baud probe failed, back to %ld\n", baud, old);
+      drain_serial();
+      if (ok)
+         set_baud(old);
+   }
+   baud_save(baudrate);
+}
+
+static void msg_init (UBYTE *buf, WORD len)
+{
+   struct fts4_init fi;
+   UBYTE            reply[7+sizeof(struct fts4_init)];
+
+   session_flags     = 0;
+   session_window    = 1;
+   session_blocksize = READSIZE;
+   session_parity    = 0;
+   rx_stream         = FALSE;
+   rto_reset();
+   batch_drop();
+
+   CopyMem("Cloanto", reply, 7);
+
+   if ( (len < 4) || (*((ULONG *) buf) != FTS4_MAGIC) )
+   {
+      log(LOG_DEBUG, "msg_init: classic AX client\n");
+      alloc_msgbuf(BUFSIZE);
+      setup_serial(baudrate, rbuf_len());
+      write_message(MSG_INIT, reply, 7);
+      return;
+   }
+
+   /* older clients may send a shorter struct */
+   fi.version   = 0;
+   fi.flags     = 0;
+   fi.window    = 0;
+   fi.blocksize = 0;
+   fi.parity    = 0;
+   CopyMem(buf, &fi, len < sizeof(fi) ? len : sizeof(fi));
+
+   session_flags = fi.flags & FTS4_SUPPORTED;
+   if (!baud_max)
+      session_flags &= ~FTS4_F_BAUD;
+   if (!fec_parity)
+      session_flags &= ~FTS4_F_FEC;
+
+   if (session_flags & FTS4_F_WINDOW)
+   {
+      session_window = fi.window > MAX_WINDOW ? MAX_WINDOW : fi.window;
+      if (session_window < 2)
+      {
+         session_window = 1;
+         session_flags &= ~FTS4_F_WINDOW;
+      }
+   }
+
+   if (session_flags & FTS4_F_BLOCKSIZE)
+   {
+      LONG bs = fi.blocksize > MAX_BLOCKSIZE ? MAX_BLOCKSIZE : fi.blocksize;
+
+      while ( (bs > READSIZE) && !alloc_msgbuf(bs + BLOCK_OVERHEAD) )
+         bs /= 2;
+
+      if (bs > READSIZE)
+         session_blocksize = bs;
+      else
+         session_flags &= ~FTS4_F_BLOCKSIZE;
+   }
+   if (!(session_flags & FTS4_F_BLOCKSIZE))
+      alloc_msgbuf(BUFSIZE);
+
+   if (lzbuf)
+      FreeMem(lzbuf, lzbuf_size);
+   lzbuf      = NULL;
+   lzbuf_size = 0;
+   if (session_flags & FTS4_F_COMPRESS)
+   {
+      /* the largest block either side sends, pos in front */
+      LONG size = msgbuf_size + 4;
+
+      lzbuf = AllocMem(size, 0);
+      if (lzbuf)
+         lzbuf_size = size;
+      else
+         session_flags &= ~FTS4_F_COMPRESS;
+   }
+
+   if (session_flags & FTS4_F_FEC)
+   {
+      /* the largest frame either side sends gets parity behind it */
+      session_parity = (fi.parity ? fi.parity : fec_parity) & ~1;
+      if (session_parity > FEC_MAX_PARITY)
+         session_parity = FEC_MAX_PARITY;
+      if ( (session_parity < 2) ||
+           !alloc_msgbuf(msgbuf_size + fec_size(msgbuf_size, session_parity)) )
+      {
+         session_parity = 0;
+         session_flags &= ~FTS4_F_FEC;
+      }
+   }
+
+   link_reset();
+
+   log(LOG_INFO, "FTS4 client v%d: flags=0x%04x window=%d blocksize=%d parity=%d\n",
+       fi.version, session_flags, session_window, session_blocksize, session_parity);
+
+   /* the client waits for our answer, so the line is idle right now */
+   setup_serial(baudrate, rbuf_len());
+
+   fi.magic     = FTS4_MAGIC;
+   fi.version   = FTS4_VERSION;
+   fi.flags     = session_flags;
+   fi.window    = session_window;
+   fi.blocksize = session_blocksize;
+   fi.parity    = session_parity;
+   CopyMem(&fi, reply+7, sizeof(fi));
+
+   write_message(MSG_INIT, reply, sizeof(reply));
+}
+
 int main(int argc, char **argv)
 {
-   UBYTE buf_serial[BUFSIZE];
+   UBYTE *buf_serial;
    ULONG signals;
    struct ax_header header;
 
@@ -1155,7 +5112,7 @@ int main(int argc, char **argv)
       closedown();
    }
 
-   io_serial->io_RBufLen  = BUFSIZE;
+   io_serial->io_RBufLen  = rbuf_len();
    io_serial->io_ExtFlags = 0;
    io_serial->io_ReadLen  = 8 ;
    io_serial->io_WriteLen = 8 ;
@@ -1170,14 +5127,25 @@ int main(int argc, char **argv)
 
    wait_mask = SIGBREAKF_CTRL_C | 1L << mp_serial->mp_SigBit;
 
-   setup_serial(baudrate);
+   setup_serial(baudrate, rbuf_len());
+
+   /* second request, so reads can be pending while we write */
+   io_serial_rd = (struct IOExtSer *) CreateExtIO(mp_serial, sizeof(struct IOExtSer)) ;
+   if (!io_serial_rd)
+   {
+      log (LOG_ERROR, "ERROR: cannot create IOExtSer.\n");
+      closedown();
+   }
+   CopyMem(io_serial, io_serial_rd, sizeof(struct IOExtSer));
 
-   timer_open = !OpenDevice("timer.device", UNIT_VBLANK, (struct IORequest*) &io_tr, 0);
+   timer_open = !OpenDevice("timer.device", UNIT_MICROHZ, (struct IORequest*) &io_tr, 0);
    if (!timer_open)
    {
       log (LOG_ERROR, "ERROR: timer.device did not open.\n");
       closedown();
    }
+   io_tr.tr_node.io_Message.mn_ReplyPort = mp_serial;
+   CopyMem(&io_tr, &io_clock, sizeof(struct timerequest));
 
    fib = (struct FileInfoBlock *)AllocMem(sizeof(struct FileInfoBlock), 0);
    if (!fib)
@@ -1200,14 +5168,22 @@ int main(int argc, char **argv)
       closedown();
    }
 
+   if (!alloc_msgbuf(BUFSIZE))
+   {
+      log (LOG_ERROR, "ERROR: out of memory (msgbuf).\n");
+      closedown();
+   }
+
    while (TRUE)
    {
-      read_message(&header, buf_serial, BUFSIZE);
+      buf_serial = msgbuf; /* msg_init() may have resized it */
+
+      read_message(&header, buf_serial, msgbuf_size);
 
       switch (header.msg) 
       {
          case MSG_INIT:
-            write_message(MSG_INIT, (UBYTE *) "Cloanto", 7);
+            msg_init(buf_serial, header.len);
             break;
 
          case MSG_FILE_RECV:
@@ -1222,6 +5198,10 @@ int main(int argc, char **argv)
             msg_block(buf_serial, header.len);
             break;
 
+         case MSG_BLOCK_LZ:
+            msg_block_lz(buf_serial, header.len);
+            break;
+
          case MSG_EOF:
             msg_eof(buf_serial, header.len);
             break;
@@ -1262,6 +5242,38 @@ int main(int argc, char **argv)
             msg_dir(buf_serial, header.len);
             break;
 
+         case MSG_FILE_QUERY:
+            msg_file_query(buf_serial, header.len);
+            break;
+
+         case MSG_FILE_RESUME:
+            msg_file_resume(buf_serial, header.len);
+            break;
+
+         case MSG_FILE_SEND_AT:
+            msg_file_send_at(buf_serial, header.len);
+            break;
+
+         case MSG_FILE_SIGS:
+            msg_file_sigs(buf_serial, header.len);
+            break;
+
+         case MSG_FILE_DELTA:
+            msg_file_delta(buf_serial, header.len);
+            break;
+
+         case MSG_FILE_BATCH:
+            msg_file_batch(buf_serial, header.len);
+            break;
+
+         case MSG_TREE_SEND:
+            msg_tree_send(buf_serial, header.len);
+            break;
+
+         case MSG_BAUD:
+            msg_baud(buf_serial, header.len);
+            break;
+
          default:
             log (LOG_ERROR, "*** ERROR: unknown message 0x%04x received!\n",
                  header.msg);
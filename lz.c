@@ -0,0 +1,127 @@
+
+#include "lz.h"
+
+#define LZ_HASH_SIZE 4096
+
+/* position + 1 of the last occurrence of each 3 byte hash, 0: none */
+static unsigned short lz_head[LZ_HASH_SIZE];
+
+#define LZ_HASH(p) ( (((unsigned) (p)[0] << 4) ^ ((unsigned) (p)[1] << 2) ^ \
+                      (unsigned) (p)[2]) & (LZ_HASH_SIZE-1) )
+
+long lz_pack(unsigned char *src, long len, unsigned char *dst, long max)
+{
+    long i    = 0;
+    long o    = 0;
+    long flag = 0;
+    int  bit  = 0;
+
+    for (i=0; i<LZ_HASH_SIZE; i++)
+        lz_head[i] = 0;
+    i = 0;
+
+    while (i < len)
+    {
+        long best = 0;
+        long from = 0;
+
+        if (!bit)
+        {
+            if (o >= max)
+                return 0;
+            flag      = o++;
+            dst[flag] = 0;
+            bit       = 0x80;
+        }
+
+        if (i + LZ_MIN_MATCH <= len)
+        {
+            unsigned h    = LZ_HASH(src + i);
+            long     cand = (long) lz_head[h] - 1;
+
+            lz_head[h] = (unsigned short) (i + 1);
+
+            if ((cand >= 0) && (i - cand <= LZ_WINDOW))
+            {
+                long n = len - i;
+
+                if (n > LZ_MAX_MATCH)
+                    n = LZ_MAX_MATCH;
+                while ((best < n) && (src[cand + best] == src[i + best]))
+                    best++;
+                from = cand;
+            }
+        }
+
+        if (best >= LZ_MIN_MATCH)
+        {
+            long off = i - from - 1;
+            long k;
+
+            if (o + 2 > max)
+                return 0;
+            dst[flag] |= bit;
+            dst[o++]   = (unsigned char) (((best - LZ_MIN_MATCH) << 4) | (off >> 8));
+            dst[o++]   = (unsigned char) (off & 0xff);
+
+            /* let later matches start inside this one */
+            for (k=1; (k < best) && (i + k + LZ_MIN_MATCH <= len); k++)
+                lz_head[LZ_HASH(src + i + k)] = (unsigned short) (i + k + 1);
+            i += best;
+        }
+        else
+        {
+            if (o >= max)
+                return 0;
+            dst[o++] = src[i++];
+        }
+        bit >>= 1;
+    }
+
+    return o;
+}
+
+long lz_unpack(unsigned char *src, long len, unsigned char *dst, long max)
+{
+    long i     = 0;
+    long o     = 0;
+    int  flags = 0;
+    int  bit   = 0;
+
+    while (i < len)
+    {
+        if (!bit)
+        {
+            flags = src[i++];
+            bit   = 0x80;
+            continue;
+        }
+
+        if (flags & bit)
+        {
+            long n, off;
+
+            if (i + 2 > len)
+                return -1;
+            n   = (src[i] >> 4) + LZ_MIN_MATCH;
+            off = (((long) (src[i] & 0x0f) << 8) | src[i+1]) + 1;
+            i  += 2;
+            if ((off > o) || (o + n > max))
+                return -1;
+            while (n--)
+            {
+                dst[o] = dst[o - off];
+                o++;
+            }
+        }
+        else
+        {
+            if (o >= max)
+                return -1;
+            dst[o++] = src[i++];
+        }
+        bit >>= 1;
+    }
+
+    return o;
+}
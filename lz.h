@@ -0,0 +1,33 @@
+#ifndef HAVE_LZ_H
+#define HAVE_LZ_H
+
+/*
+ * LZSS codec for MSG_BLOCK payloads (FTS4_F_COMPRESS)
+ *
+ * a packed block is a sequence of groups: one flag byte, then up to 8
+ * items, the most significant flag bit describing the first one:
+ *
+ *   bit 0 : literal, one byte
+ *   bit 1 : match, two bytes  LLLLOOOO OOOOOOOO
+ *           copy L+3 (3..18) bytes from O+1 (1..4096) bytes back
+ *
+ * the packer keeps a 4k hash table (8k of memory) and looks at one
+ * candidate per position, which is fast enough for a 68000 at serial
+ * speeds. Blocks are packed independently.
+ */
+
+#define LZ_MIN_MATCH   3
+#define LZ_MAX_MATCH  18
+#define LZ_WINDOW   4096
+
+/*
+ * packs len bytes of src into dst, returns the packed size or 0 if that
+ * would exceed max bytes (send the block raw then)
+ */
+long lz_pack(unsigned char *src, long len, unsigned char *dst, long max);
+
+/* returns the unpacked size, -1 if src is corrupt or does not fit max */
+long lz_unpack(unsigned char *src, long len, unsigned char *dst, long max);
+
+#endif
+